@@ -6,97 +6,31 @@
 #include "led-matrix.h"
 #include "threaded-canvas-manipulator.h"
 
-#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <string>
+#include <vector>
 
 using std::min;
 using std::max;
 
 using namespace rgb_matrix;
 
-// This is an example how to use the Canvas abstraction to map coordinates.
-//
-// This is a Canvas that delegates to some other Canvas (typically, the RGB
-// matrix).
-//
-// Here, we want to address four 32x32 panels as one big 64x64 panel. Physically,
-// we chain them together and do a 180 degree 'curve', somewhat like this:
-// [>] [>]
-//         v
-// [<] [<]
-class LargeSquare64x64Canvas : public Canvas {
-public:
-  // This class takes over ownership of the delegatee.
-  LargeSquare64x64Canvas(Canvas *delegatee) : delegatee_(delegatee) {
-    // Our assumptions of the underlying geometry:
-    assert(delegatee->height() == 32);
-    assert(delegatee->width() == 128);
-  }
-  virtual ~LargeSquare64x64Canvas() { delete delegatee_; }
-
-  virtual void Clear() { delegatee_->Clear(); }
-  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
-    delegatee_->Fill(red, green, blue);
-  }
-  virtual int width() const { return 64; }
-  virtual int height() const { return 64; }
-  virtual void SetPixel(int x, int y,
-                        uint8_t red, uint8_t green, uint8_t blue) {
-    if (x < 0 || x >= width() || y < 0 || y >= height()) return;
-    // We have up to column 64 one direction, then folding around. Lets map
-    if (y > 31) {
-      x = 127 - x;
-      y = 63 - y;
-    }
-    delegatee_->SetPixel(x, y, red, green, blue);
-  }
-
-private:
-Canvas *delegatee_;
-};
-
-
-class LargeSquare96x64Canvas : public Canvas {
-public:
-  // This class takes over ownership of the delegatee.
-  LargeSquare96x64Canvas(Canvas *delegatee) : delegatee_(delegatee) {
-    // Our assumptions of the underlying geometry:
-    assert(delegatee->height() == 32);
-    assert(delegatee->width() == 192);
-  }
-  virtual ~LargeSquare96x64Canvas() { delete delegatee_; }
-
-  virtual void Clear() { delegatee_->Clear(); }
-  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
-    delegatee_->Fill(red, green, blue);
-  }
-  virtual int width() const { return 96; }
-  virtual int height() const { return 64; }
-  virtual void SetPixel(int x, int y,
-                        uint8_t red, uint8_t green, uint8_t blue) {
-    if (x < 0 || x >= width() || y < 0 || y >= height()) return;
-    // We have up to column 64 one direction, then folding around. Lets map
-    if (y > 31) {
-      x = 191 - x;
-      y = 63 - y;
-    }
-    delegatee_->SetPixel(x, y, red, green, blue);
-  }
-
-
-
-private:
-  Canvas *delegatee_;
-};
-
 /*
  * The following are demo image generators. They all use the utility
  * class ThreadedCanvasManipulator to generate new frames.
@@ -109,7 +43,7 @@ public:
   void Run() {
     uint32_t continuum = 0;
     while (running()) {
-      usleep(5 * 1000);
+      SleepMillis(5);
       continuum += 1;
       continuum %= 3 * 255;
       int r = 0, g = 0, b = 0;
@@ -176,7 +110,7 @@ public:
         }
       }
       count++;
-      sleep(2);
+      SleepMillis(2000);
     }
   }
 };
@@ -212,7 +146,7 @@ public:
     int rotation = 0;
     while (running()) {
       ++rotation;
-      usleep(15 * 1000);
+      SleepMillis(15);
       rotation %= 360;
       for (int x = min_rotate; x < max_rotate; ++x) {
         for (int y = min_rotate; y < max_rotate; ++y) {
@@ -242,143 +176,471 @@ private:
   }
 };
 
+// A binary PPM (P6) image. The file is memory-mapped, so the pixels are
+// used right where they are: loading copies nothing, and only the parts of
+// the image that are looked at are actually read from disk. Images that
+// can't be mapped (e.g. larger than the address space) or are no longer
+// mapped (see Unmap()) are read as needed, a window of columns at a time.
+// To replace an image that is shown, write a new file and rename it,
+// rather than rewriting it in place.
+class PPMImage {
+public:
+  PPMImage() : fd_(-1), map_(NULL), map_size_(0), data_offset_(0),
+               width_(0), height_(0), max_value_(0) {}
+  ~PPMImage() { Close(); }
+
+  // Open "filename"; with "map" false, the pixels are always read with
+  // ReadColumns(), as for images that are kept (see Unmap()).
+  bool Open(const char *filename, bool map = true) {
+    Close();
+    fd_ = open(filename, O_RDONLY);
+    if (fd_ < 0) {
+      fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+      return false;
+    }
+    const char *error = ParseHeader();
+    struct stat st;
+    if (error == NULL && fstat(fd_, &st) != 0)
+      error = strerror(errno);
+    const off_t sample_bytes = (max_value_ < 256) ? 1 : 2;
+    if (error == NULL
+        && (st.st_size - data_offset_) / (3 * sample_bytes) / width_
+        < height_) {
+      error = "Not enough pixels in file.";
+    }
+    if (error != NULL) {
+      fprintf(stderr, "%s: %s\n", filename, error);
+      Close();
+      return false;
+    }
+    if (map && (uint64_t) st.st_size <= SIZE_MAX) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+      if (map != MAP_FAILED) {
+        map_ = (const uint8_t*) map;
+        map_size_ = st.st_size;
+      }
+    }
+    fprintf(stderr, "Read image '%s' with %dx%d%s\n", filename,
+            width_, height_, map_ ? "" : " (streamed)");
+    return true;
+  }
+
+  void Close() {
+    Unmap();
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    width_ = height_ = 0;
+  }
+
+  // From now on, read the pixels from the file with ReadColumns(). If a
+  // mapped file gets shorter, touching what is gone kills the process with
+  // SIGBUS; reading shows black there instead. So unmap images that are
+  // kept for longer.
+  void Unmap() {
+    if (map_) munmap((void*) map_, map_size_);
+    map_ = NULL;
+    map_size_ = 0;
+  }
+
+  // Exchange with "other", e.g. to pass on an image loaded in another thread.
+  void Swap(PPMImage *other) {
+    std::swap(fd_, other->fd_);
+    std::swap(map_, other->map_);
+    std::swap(map_size_, other->map_size_);
+    std::swap(data_offset_, other->data_offset_);
+    std::swap(width_, other->width_);
+    std::swap(height_, other->height_);
+    std::swap(max_value_, other->max_value_);
+  }
+
+  bool IsValid() const { return width_ > 0 && height_ > 0; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // The pixels, 3 bytes each, "3 * width()" bytes per row, if they can be
+  // used directly; otherwise NULL, then use ReadColumns().
+  const uint8_t *pixels() const {
+    return (map_ && max_value_ == 255) ? map_ + data_offset_ : NULL;
+  }
+
+  // Read "span" columns starting at "x" of the first "rows" rows to
+  // "buffer" with 3 bytes per pixel, scaled to 0..255.
+  void ReadColumns(int x, int span, int rows, uint8_t *buffer) const {
+    const int sample_bytes = (max_value_ < 256) ? 1 : 2;
+    uint8_t samples[128 * 3 * 2];
+    for (int y = 0; y < rows; ++y) {
+      for (int done = 0; done < span; /**/) {
+        const int count = min(span - done, 128);
+        const size_t bytes = 3 * count * sample_bytes;
+        const off_t offset = data_offset_
+          + ((off_t) y * width_ + x + done) * 3 * sample_bytes;
+        if (map_) {
+          memcpy(samples, map_ + offset, bytes);
+        } else if (pread(fd_, samples, bytes, offset) != (ssize_t) bytes) {
+          memset(samples, 0, bytes);  // File got shorter.
+        }
+        for (int i = 0; i < 3 * count; ++i) {
+          const int value = (sample_bytes == 1)
+            ? samples[i] : (samples[2 * i] << 8 | samples[2 * i + 1]);
+          *buffer++ = (value * 255 + max_value_ / 2) / max_value_;
+        }
+        done += count;
+      }
+    }
+  }
+
+private:
+  // Parse "P6 <width> <height> <maxval>" with whitespace and comments
+  // anywhere in between. Returns NULL or what is wrong.
+  const char *ParseHeader() {
+    char buffer[512];
+    int len = 0, pos = 0;
+    data_offset_ = 0;
+    int c = NextHeaderChar(buffer, &len, &pos);
+    if (c != 'P' || NextHeaderChar(buffer, &len, &pos) != '6')
+      return "Can only handle P6 as PPM type.";
+    int values[3];  // Width, height, maxval.
+    for (int i = 0; i < 3; ++i) {
+      // Whitespace and comments up to the number.
+      c = NextHeaderChar(buffer, &len, &pos);
+      while (c == '#' || isspace(c)) {
+        if (c == '#') {
+          while (c != '\n' && c != EOF) c = NextHeaderChar(buffer, &len, &pos);
+        }
+        c = NextHeaderChar(buffer, &len, &pos);
+      }
+      if (!isdigit(c))
+        return "Width, height and maxval expected.";
+      values[i] = 0;
+      while (isdigit(c)) {
+        if (values[i] > (INT_MAX - 9) / 10) return "Number too large.";
+        values[i] = values[i] * 10 + (c - '0');
+        c = NextHeaderChar(buffer, &len, &pos);
+      }
+    }
+    if (!isspace(c))  // Exactly one whitespace before the pixels.
+      return "Whitespace expected after maxval.";
+    width_ = values[0];
+    height_ = values[1];
+    max_value_ = values[2];
+    if (width_ <= 0 || height_ <= 0)
+      return "Empty image.";
+    if (width_ > INT_MAX / 3)
+      return "Image too wide.";  // Row stride needs to fit an int.
+    if (max_value_ <= 0 || max_value_ > 65535)
+      return "maxval needs to be 1..65535.";
+    return NULL;
+  }
+
+  // Next character of the header, read in small blocks; "data_offset_" is
+  // the position after it in the file.
+  int NextHeaderChar(char *buffer, int *len, int *pos) {
+    if (*pos == *len) {
+      *len = read(fd_, buffer, 512);
+      *pos = 0;
+      if (*len <= 0) {
+        *len = 0;
+        return EOF;
+      }
+    }
+    ++data_offset_;
+    return (unsigned char) buffer[(*pos)++];
+  }
+
+  int fd_;
+  const uint8_t *map_;   // The whole file, or NULL if not mapped.
+  size_t map_size_;
+  off_t data_offset_;    // Where the pixels start in the file.
+  int width_;
+  int height_;
+  int max_value_;
+};
+
 class ImageScroller : public ThreadedCanvasManipulator {
 public:
   // Scroll image with "scroll_jumps" pixels every "scroll_ms" milliseconds.
   // If "scroll_ms" is negative, don't do any scrolling.
-  ImageScroller(Canvas *m, int scroll_jumps, int scroll_ms = 30)
-    : ThreadedCanvasManipulator(m), scroll_jumps_(scroll_jumps),
+  ImageScroller(RGBMatrix *m, int scroll_jumps, int scroll_ms = 30)
+    : ThreadedCanvasManipulator(m), matrix_(m), scroll_jumps_(scroll_jumps),
       scroll_ms_(scroll_ms),
+      bitplanes_(NULL), use_bitplanes_(false), scan_scrolling_(false),
       horizontal_position_(0) {
   }
 
   virtual ~ImageScroller() {
     Stop();
     WaitStopped();   // only now it is safe to delete our instance variables.
+    delete bitplanes_;
+    if (scan_scrolling_) matrix_->SetScanOffset(0);
   }
 
-  // _very_ simplified. Can only read binary P6 PPM. Expects newlines in headers
-  // Not really robust. Use at your own risk :)
-  // This allows reload of an image while things are running, e.g. you can
-  // life-update the content.
+  // Load a binary (P6) PPM image. This allows reload of an image while
+  // things are running, e.g. you can life-update the content. The image is
+  // mapped, not copied (see PPMImage), until it is drawn or converted to
+  // bitplanes.
   bool LoadPPM(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (f == NULL) return false;
-    char header_buf[256];
-    const char *line = ReadLine(f, header_buf, sizeof(header_buf));
-#define EXIT_WITH_MSG(m) { fprintf(stderr, "%s: %s |%s", filename, m, line); \
-      fclose(f); return false; }
-    if (sscanf(line, "P6 ") == EOF)
-      EXIT_WITH_MSG("Can only handle P6 as PPM type.");
-    line = ReadLine(f, header_buf, sizeof(header_buf));
-    int new_width, new_height;
-    if (!line || sscanf(line, "%d %d ", &new_width, &new_height) != 2)
-      EXIT_WITH_MSG("Width/height expected");
-    int value;
-    line = ReadLine(f, header_buf, sizeof(header_buf));
-    if (!line || sscanf(line, "%d ", &value) != 1 || value != 255)
-      EXIT_WITH_MSG("Only 255 for maxval allowed.");
-    const size_t pixel_count = new_width * new_height;
-    Pixel *new_image = new Pixel [ pixel_count ];
-    assert(sizeof(Pixel) == 3);   // we make that assumption.
-    if (fread(new_image, sizeof(Pixel), pixel_count, f) != pixel_count) {
-      line = "";
-      EXIT_WITH_MSG("Not enough pixels read.");
-    }
-#undef EXIT_WITH_MSG
-    fclose(f);
-    fprintf(stderr, "Read image '%s' with %dx%d\n", filename,
-            new_width, new_height);
+    PPMImage image;
+    if (!image.Open(filename))
+      return false;
     horizontal_position_ = 0;
     MutexLock l(&mutex_new_image_);
-    new_image_.Delete();  // in case we reload faster than is picked up
-    new_image_.image = new_image;
-    new_image_.width = new_width;
-    new_image_.height = new_height;
+    new_image_.Swap(&image);  // One we didn't get to is closed with "image".
     return true;
   }
 
   void Run() {
     const int screen_height = canvas()->height();
     const int screen_width = canvas()->width();
+    // For images that can't be used directly.
+    std::vector<uint8_t> window(screen_width * screen_height * 3);
     while (running()) {
+      bool new_image = false;
       {
         MutexLock l(&mutex_new_image_);
         if (new_image_.IsValid()) {
-          current_image_.Delete();
-          current_image_ = new_image_;
-          new_image_.Reset();
+          current_image_.Swap(&new_image_);
+          new_image_.Close();
+          new_image = true;
         }
       }
+      if (new_image) {
+        // We only draw the rows the image has; make sure the rest is black.
+        if (current_image_.height() < screen_height)
+          canvas()->Clear();
+        // An image as wide as the screen is drawn once, then scrolled by
+        // the refresh thread (if the panels allow).
+        scan_scrolling_ = (matrix_->SetScanOffset(0) && scroll_ms_ > 0
+                           && current_image_.width() == screen_width);
+        use_bitplanes_ = false;
+        if (!scan_scrolling_)
+          ConvertToBitplanes(&window[0]);
+      }
       if (!current_image_.IsValid()) {
-        usleep(100 * 1000);
+        SleepMillis(100);
         continue;
       }
-      for (int x = 0; x < screen_width; ++x) {
-        for (int y = 0; y < screen_height; ++y) {
-          const Pixel &p = current_image_.getPixel(
-                     (horizontal_position_ + x) % current_image_.width, y);
-          canvas()->SetPixel(x, y, p.red, p.green, p.blue);
+      // Copy the visible window in (at most) two blocks: up to the end of
+      // the image, then wrapping around to its beginning.
+      const int image_width = current_image_.width();
+      const int rows = min(screen_height, current_image_.height());
+      const uint8_t *pixels = current_image_.pixels();
+      const int position = horizontal_position_ % image_width;
+      int image_x = scan_scrolling_ ? 0 : position;
+      const bool draw = new_image || !scan_scrolling_;
+      for (int x = 0; draw && x < screen_width; image_x = 0) {
+        const int span = min(screen_width - x, image_width - image_x);
+        if (use_bitplanes_
+            && matrix_->CopyColumns(bitplanes_, image_x, x, span)) {
+          // Done, without any conversion.
+        } else if (pixels) {
+          canvas()->SetPixels(x, 0, span, rows, pixels + 3 * image_x,
+                              3 * image_width);
+        } else {
+          current_image_.ReadColumns(image_x, span, rows, &window[0]);
+          canvas()->SetPixels(x, 0, span, rows, &window[0], 3 * span);
         }
+        x += span;
       }
+      if (new_image) {
+        // Scrolling copies bitplanes or moves the scan offset; only big
+        // images are still read while scrolling, and then not through the
+        // mapping (see PPMImage::Unmap()).
+        current_image_.Unmap();
+      }
+      if (scan_scrolling_)
+        matrix_->SetScanOffset(position);
       horizontal_position_ += scroll_jumps_;
-      if (horizontal_position_ < 0) horizontal_position_ = current_image_.width;
+      if (horizontal_position_ < 0) horizontal_position_ = image_width;
       if (scroll_ms_ <= 0) {
         // No scrolling. We don't need the image anymore.
-        current_image_.Delete();
+        current_image_.Close();
       } else {
-        usleep(scroll_ms_ * 1000);
+        SleepMillis(scroll_ms_);
       }
     }
   }
 
 private:
-  struct Pixel {
-    Pixel() : red(0), green(0), blue(0){}
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-  };
-
-  struct Image {
-    Image() : width(-1), height(-1), image(NULL) {}
-    ~Image() { Delete(); }
-    void Delete() { delete [] image; Reset(); }
-    void Reset() { image = NULL; width = -1; height = -1; }
-    inline bool IsValid() { return image && height > 0 && width > 0; }
-    const Pixel &getPixel(int x, int y) {
-      static Pixel black;
-      if (x < 0 || x >= width || y < 0 || y >= height) return black;
-      return image[x + width * y];
+  // Images up to this size are converted to bitplanes once when loaded, so
+  // that scrolling them just copies columns.
+  static const int kMaxBitplanePixels = 1 << 20;
+
+  // Convert the current image to bitplanes_, if it is to be scrolled and
+  // not too large. "window" has room for the pixels of the screen.
+  void ConvertToBitplanes(uint8_t *window) {
+    const int width = current_image_.width();
+    const int rows = min(canvas()->height(), current_image_.height());
+    use_bitplanes_ = false;
+    if (scroll_ms_ <= 0 || width > kMaxBitplanePixels / rows)
+      return;
+    if (bitplanes_ == NULL || bitplanes_->width() != width) {
+      delete bitplanes_;  // Only a new size needs a new one.
+      bitplanes_ = matrix_->CreateBitplaneImage(width);
+      if (bitplanes_ == NULL)
+        return;  // Panels are not in a row.
     }
-
-    int width;
-    int height;
-    Pixel *image;
-  };
-
-  // Read line, skip comments.
-  char *ReadLine(FILE *f, char *buffer, size_t len) {
-    char *result;
-    do {
-      result = fgets(buffer, len, f);
-    } while (result != NULL && result[0] == '#');
-    return result;
+    bitplanes_->Clear();
+    const uint8_t *pixels = current_image_.pixels();
+    const int step = canvas()->width();
+    for (int x = 0; x < width; x += step) {
+      const int span = min(step, width - x);
+      if (pixels) {
+        bitplanes_->SetPixels(x, 0, span, rows, pixels + 3 * x, 3 * width);
+      } else {
+        current_image_.ReadColumns(x, span, rows, window);
+        bitplanes_->SetPixels(x, 0, span, rows, window, 3 * span);
+      }
+    }
+    use_bitplanes_ = true;
   }
 
+  RGBMatrix *const matrix_;
   const int scroll_jumps_;
   const int scroll_ms_;
 
   // Current image is only manipulated in our thread.
-  Image current_image_;
+  PPMImage current_image_;
+  BitplaneImage *bitplanes_;  // The current image, if use_bitplanes_.
+  bool use_bitplanes_;
+  bool scan_scrolling_;       // Scrolled with RGBMatrix::SetScanOffset().
 
   // New image can be loaded from another thread, then taken over in main thread.
   Mutex mutex_new_image_;
-  Image new_image_;
+  PPMImage new_image_;
 
   int32_t horizontal_position_;
 };
 
+// Show the PPM images in a directory one after the other, each for a
+// while, e.g. as a picture frame. The next image is loaded and drawn into
+// a FrameCanvas while the current one is shown; the two are swapped at the
+// next refresh, so there is no gap. The directory is watched with inotify:
+// new images are in the playlist as soon as they are written.
+class Playlist : public ThreadedCanvasManipulator {
+public:
+  Playlist(RGBMatrix *m, const char *directory, int show_seconds)
+    : ThreadedCanvasManipulator(m), matrix_(m), directory_(directory),
+      show_millis_(show_seconds * 1000LL), inotify_fd_(-1) {
+  }
+
+  virtual ~Playlist() {
+    Stop();
+    WaitStopped();   // only now it is safe to delete our instance variables.
+    if (inotify_fd_ >= 0) close(inotify_fd_);
+  }
+
+  // Start watching the directory and read what is in there.
+  bool Init() {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0
+        || inotify_add_watch(inotify_fd_, directory_.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO
+                             | IN_MOVED_FROM | IN_DELETE) < 0) {
+      perror(directory_.c_str());
+      return false;
+    }
+    return ReadDirectory();
+  }
+
+  void Run() {
+    FrameCanvas *next = matrix_->CreateFrameCanvas();
+    std::vector<uint8_t> window(canvas()->width() * canvas()->height() * 3);
+    int64_t due = 0;  // Time to show the next image.
+    while (running()) {
+      // Draw the next image while the current one is still shown. Files
+      // that are not (or not yet) images are skipped.
+      bool ready = false;
+      for (size_t i = 0; !ready && i < files_.size(); ++i) {
+        ready = Draw(NextFile(), next, &window[0]);
+      }
+
+      // Wait until it is due; without one, until the directory changes.
+      for (int64_t now = GetTimeMillis(); running() && (!ready || now < due);
+           now = GetTimeMillis()) {
+        if (DirectoryChanged()) {
+          ReadDirectory();
+          if (!ready) break;  // Maybe there is one now.
+        }
+        SleepMillis(ready ? min<int64_t>(due - now, 100) : 100);
+      }
+      if (!ready || !running())
+        continue;
+
+      next = matrix_->SwapOnVSync(next);
+      due = GetTimeMillis() + show_millis_;
+    }
+  }
+
+private:
+  static int64_t GetTimeMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+  }
+
+  // The file names in the directory, sorted. Hidden files are left out,
+  // so images can be written to a hidden file and then renamed.
+  bool ReadDirectory() {
+    DIR *dir = opendir(directory_.c_str());
+    if (dir == NULL) {
+      perror(directory_.c_str());
+      return false;
+    }
+    files_.clear();
+    while (const struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.')
+        files_.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(files_.begin(), files_.end());
+    return true;
+  }
+
+  // Read the pending inotify events. Returns true if there were any.
+  bool DirectoryChanged() {
+    char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(inotify_fd_, events, sizeof(events)) > 0)
+      changed = true;
+    return changed;
+  }
+
+  // The file after the last one, in the order of names; so the playlist
+  // goes on where it was when files are added or removed.
+  const std::string &NextFile() {
+    std::vector<std::string>::const_iterator it
+      = std::upper_bound(files_.begin(), files_.end(), last_file_);
+    last_file_ = (it == files_.end()) ? files_.front() : *it;
+    return last_file_;
+  }
+
+  // Draw the image in "file" to the top left corner of "frame", clipped.
+  // "window" has room for the pixels of the frame. The file is not mapped:
+  // whoever writes to the directory might rewrite it in place while we
+  // read it, which would kill us with SIGBUS; this way, we only see black.
+  bool Draw(const std::string &file, FrameCanvas *frame, uint8_t *window) {
+    PPMImage image;
+    if (!image.Open((directory_ + "/" + file).c_str(), false))
+      return false;
+    const int width = min(frame->width(), image.width());
+    const int rows = min(frame->height(), image.height());
+    frame->Clear();
+    image.ReadColumns(0, width, rows, window);
+    frame->SetPixels(0, 0, width, rows, window, 3 * width);
+    return true;
+  }
+
+  RGBMatrix *const matrix_;
+  const std::string directory_;
+  const int64_t show_millis_;
+  int inotify_fd_;
+
+  // Only used in our thread once started.
+  std::vector<std::string> files_;
+  std::string last_file_;
+};
+
 
 // Abelian sandpile
 // Contributed by: Vliedel
@@ -445,7 +707,7 @@ public:
           }
         }
       }
-      usleep(delay_ms_ * 1000); // ms
+      SleepMillis(delay_ms_);
     }
   }
 
@@ -561,7 +823,7 @@ public:
             canvas()->SetPixel(x, y, 0, 0, 0);
         }
       }
-      usleep(delay_ms_ * 1000); // ms
+      SleepMillis(delay_ms_);
     }
   }
 
@@ -712,7 +974,7 @@ public:
       if (antX_ < 0 || antX_ >= width_ || antY_ < 0 || antY_ >= height_)
         return;
       updatePixel(antX_, antY_);
-      usleep(delay_ms_ * 1000);
+      SleepMillis(delay_ms_);
     }
   }
 
@@ -832,7 +1094,7 @@ public:
           drawBarRow(i, y, 0, 0, 0);
         }
       }
-      usleep(delay_ms_ * 1000);
+      SleepMillis(delay_ms_);
     }
   }
 
@@ -857,23 +1119,103 @@ private:
   int t_;
 };
 
+// Periodically writes the refresh statistics of the matrix to a file, so
+// that flicker can be watched on a running display.
+class StatisticsWriter : public Thread {
+public:
+  StatisticsWriter(RGBMatrix *matrix, FILE *out)
+    : matrix_(matrix), out_(out) {}
+  virtual ~StatisticsWriter() {
+    stop_.Stop();
+    WaitStopped();
+  }
+
+  void Run() {
+    RGBMatrix::RefreshStatistics last;
+    memset(&last, 0, sizeof(last));
+    while (stop_.SleepMillis(1000)) {
+      RGBMatrix::RefreshStatistics now;
+      if (!matrix_->GetRefreshStatistics(&now))
+        continue;
+      const uint64_t frames = now.frames - last.frames;
+      const int64_t busy = ((now.clock_in_nanos - last.clock_in_nanos)
+                            + (now.display_nanos - last.display_nanos)
+                            + (now.dark_nanos - last.dark_nanos));
+      if (frames == 0 || busy <= 0)
+        continue;
+      // Worst average error of any bitplane in this interval.
+      int64_t worst_error = 0;
+      for (int b = 0; b < RGBMatrix::RefreshStatistics::kBitplanes; ++b) {
+        const uint64_t count = now.bitplane_count[b] - last.bitplane_count[b];
+        if (count == 0) continue;
+        const int64_t error = (now.bitplane_error_nanos[b]
+                               - last.bitplane_error_nanos[b]) / (int64_t)count;
+        if (llabs(error) > llabs(worst_error)) worst_error = error;
+      }
+      fprintf(out_, "%6.1fHz  jitter %6.1fus  swapped %llu dropped %llu  "
+              "clock-in %4.1f%%  worst bitplane error %lldns\n",
+              frames * 1e9 / busy,
+              (now.max_frame_nanos - now.min_frame_nanos) / 1e3,
+              (unsigned long long) (now.frames_swapped - last.frames_swapped),
+              (unsigned long long) (now.frames_dropped - last.frames_dropped),
+              100.0 * (now.clock_in_nanos - last.clock_in_nanos) / busy,
+              (long long) worst_error);
+      // Refresh rate by the bitplanes clocked in per row.
+      for (int p = 0; p <= RGBMatrix::RefreshStatistics::kBitplanes; ++p) {
+        const uint64_t count = (now.frames_by_planes[p]
+                                - last.frames_by_planes[p]);
+        const int64_t nanos = (now.frame_nanos_by_planes[p]
+                               - last.frame_nanos_by_planes[p]);
+        if (count > 0 && nanos > 0) {
+          fprintf(out_, "    %2d planes/row: %6.1fHz (%llu frames)\n",
+                  p, count * 1e9 / nanos, (unsigned long long) count);
+        }
+      }
+      fflush(out_);
+      last = now;
+    }
+  }
+
+private:
+  RGBMatrix *const matrix_;
+  FILE *const out_;
+  StopRequest stop_;
+};
+
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s <options> -D <demo-nr> [optional parameter]\n",
           progname);
   fprintf(stderr, "Options:\n"
-          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32. "
-          "Default: 32\n"
+          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32, "
+          "64 for 64x32.\n"
+          "\t                Default: 32\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
+          "\t-C <parallel> : Parallel chains. 1..3. Default: 1.\n"
+          "\t-M <mux>      : Multiplexing. 0: direct, 1: stripe, 2: checkered "
+          "(outdoor\n"
+          "\t                1:4 or 1:8 scan panels). Default: 0\n"
+          "\t-b            : Packed bitplanes: less memory for long chains\n"
+          "\t-O            : Optimize for static content\n"
+          "\t-T            : Temporal dithering: full color depth with "
+          "less PWM bits\n"
+          "\t-A <panels>   : Arrangement of the panels, e.g. 'serpentine 2x2'\n"
+          "\t                or '@<file>' to read it from a file\n"
+          "\t                (see pixel-mapper.h).\n"
           "\t-L            : 'Large' display, composed out of 4 times 32x32\n"
           "\t-V            : 'Verry Large' display, composed out of 6 times 32x32\n"
           "\t-m <ms>       : Scroll speed 0 for disable\n"
+          "\t-w <seconds>  : Time each image of a playlist is shown. "
+          "Default: 30\n"
           "\t-p <pwm-bits> : Bits used for PWM. Something between 1..11\n"
           "\t-l            : Don't do luminance correction (CIE1931)\n"
+          "\t-B <percent>  : Brightness. 0..100. Default: 100\n"
           "\t-D <demo-nr>  : Always needs to be set\n"
           "\t-d            : run as daemon. Use this when starting in\n"
           "\t                /etc/init.d, but also when running without\n"
           "\t                terminal (e.g. cron).\n"
           "\t-t <seconds>  : Run for these number of seconds, then exit.\n"
+          "\t-s <file>     : Write refresh statistics every second to file\n"
+          "\t                ('-' for stderr).\n"
           "\t       (if neither -d nor -t are supplied, waits for <RETURN>)\n");
   fprintf(stderr, "Demos, choosen with -D\n");
   fprintf(stderr, "\t0  - some rotating square\n"
@@ -885,7 +1227,10 @@ static int usage(const char *progname) {
           "\t6  - Abelian sandpile model (-m <time-step-ms>)\n"
           "\t7  - Conway's game of life (-m <time-step-ms>)\n"
           "\t8  - Langton's ant (-m <time-step-ms>)\n"
-          "\t9  - Volume bars (-m <time-step-ms>)\n");
+          "\t9  - Volume bars (-m <time-step-ms>)\n"
+          "\t10 - Playlist: the PPM images in a directory, one after the "
+          "other,\n"
+          "\t     as they are written to it (-w <seconds>)\n");
   fprintf(stderr, "Example:\n\t%s -t 10 -D 1 runtext.ppm\n"
           "Scrolls the runtext for 10 seconds\n", progname);
   return 1;
@@ -897,17 +1242,24 @@ int main(int argc, char *argv[]) {
   int demo = -1;
   int rows = 32;
   int chain = 1;
+  int parallel = 1;
+  int multiplexing = 0;
   int scroll_ms = 30;
   int pwm_bits = -1;
+  int brightness = 100;
   int scroll_jumps = 1;
-  bool large_display = false;
-  bool verry_large_display = false;
+  int show_seconds = 30;
+  const char *panel_arrangement = NULL;
   bool do_luminance_correct = true;
+  bool packed_bitplanes = false;
+  bool optimize_static_content = false;
+  bool temporal_dithering = false;
 
   const char *demo_parameter = NULL;
+  const char *statistics_file = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "dlD:t:r:p:P:c:m:L:V")) != -1) {
+  while ((opt = getopt(argc, argv, "dlbOTD:t:r:p:P:c:C:M:A:m:s:w:B:L:V")) != -1) {
     switch (opt) {
     case 'D':
       demo = atoi(optarg);
@@ -933,10 +1285,22 @@ int main(int argc, char *argv[]) {
       chain = atoi(optarg);
       break;
 
+    case 'C':
+      parallel = atoi(optarg);
+      break;
+
+    case 'M':
+      multiplexing = atoi(optarg);
+      break;
+
     case 'm':
       scroll_ms = atoi(optarg);
       break;
 
+    case 'w':
+      show_seconds = atoi(optarg);
+      break;
+
     case 'p':
       pwm_bits = atoi(optarg);
       break;
@@ -945,18 +1309,46 @@ int main(int argc, char *argv[]) {
       do_luminance_correct = !do_luminance_correct;
       break;
 
+    case 'B':
+      brightness = atoi(optarg);
+      break;
+
+    case 's':
+      statistics_file = optarg;
+      break;
+
+    case 'b':
+      packed_bitplanes = true;
+      break;
+
+    case 'O':
+      optimize_static_content = true;
+      break;
+
+    case 'T':
+      temporal_dithering = true;
+      break;
+
+    case 'A':
+      panel_arrangement = optarg;
+      break;
+
     case 'L':
-      // The 'large' display assumes a chain of four displays with 32x32
+      // The 'large' display assumes a chain of four displays with 32x32,
+      // folded to a square of 64x64:
+      // [>] [>]
+      //         v
+      // [<] [<]
       chain = 4;
       rows = 32;
-      large_display = true;
+      panel_arrangement = "serpentine 2x2";
       break;
       
     case 'V':
-      // The 'large' display assumes a chain of six displays with 32x32
+      // The 'verry large' display: six displays with 32x32, folded to 96x64.
       chain = 6;
       rows = 32;
-      verry_large_display = true;
+      panel_arrangement = "serpentine 3x2";
       break;
       
     default: /* '?' */
@@ -979,8 +1371,13 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  if (rows != 16 && rows != 32) {
-    fprintf(stderr, "Rows can either be 16 or 32\n");
+  if (rows != 16 && rows != 32 && rows != 64) {
+    fprintf(stderr, "Rows can either be 16, 32 or 64\n");
+    return 1;
+  }
+
+  if (multiplexing < 0 || multiplexing > 2) {
+    fprintf(stderr, "Multiplexing can be 0, 1 or 2\n");
     return 1;
   }
 
@@ -991,6 +1388,10 @@ int main(int argc, char *argv[]) {
   if (chain > 8) {
     fprintf(stderr, "That is a long chain. Expect some flicker.\n");
   }
+  if (parallel < 1 || parallel > 3) {
+    fprintf(stderr, "Parallel outside usable range.\n");
+    return 1;
+  }
 
   // Initialize GPIO pins. This might fail when we don't have permissions.
   GPIO io;
@@ -1007,24 +1408,31 @@ int main(int argc, char *argv[]) {
   }
 
   // The matrix, our 'frame buffer' and display updater.
-  RGBMatrix *matrix = new RGBMatrix(&io, rows, chain);
+  RGBMatrix::Options matrix_options;
+  matrix_options.rows = rows;
+  matrix_options.chained_displays = chain;
+  matrix_options.parallel_chains = parallel;
+  matrix_options.multiplexing
+    = static_cast<RGBMatrix::Multiplexing>(multiplexing);
+  if (packed_bitplanes)
+    matrix_options.bitplane_layout = RGBMatrix::kPackedBitplanes;
+  matrix_options.optimize_static_content = optimize_static_content;
+  matrix_options.temporal_dithering = temporal_dithering;
+  matrix_options.panel_arrangement = panel_arrangement;
+  RGBMatrix *matrix = new RGBMatrix(&io, matrix_options);
   matrix->set_luminance_correct(do_luminance_correct);
   if (pwm_bits >= 0 && !matrix->SetPWMBits(pwm_bits)) {
     fprintf(stderr, "Invalid range of pwm-bits\n");
     return 1;
   }
+  if (brightness < 0 || brightness > 100
+      || !matrix->SetBrightness(brightness)) {
+    fprintf(stderr, "Brightness outside usable range\n");
+    return 1;
+  }
 
   Canvas *canvas = matrix;
 
-  if (large_display) {
-    // Mapping the coordinates of a 32x128 display mapped to a square of 64x64
-    canvas = new LargeSquare64x64Canvas(canvas);
-  }
-
-  if (verry_large_display) {
-    // Mapping the coordinates of a 32x128 display mapped to a square of 64x64
-    canvas = new LargeSquare96x64Canvas(canvas);
-  }
   // The ThreadedCanvasManipulator objects are filling
   // the matrix continuously.
   ThreadedCanvasManipulator *image_gen = NULL;
@@ -1036,7 +1444,7 @@ int main(int argc, char *argv[]) {
   case 1:
   case 2:
     if (demo_parameter) {
-      ImageScroller *scroller = new ImageScroller(canvas,
+      ImageScroller *scroller = new ImageScroller(matrix,
                                                   demo == 1 ? 1*scroll_jumps : -1*scroll_jumps,
                                                   scroll_ms);
       if (!scroller->LoadPPM(demo_parameter))
@@ -1075,6 +1483,19 @@ int main(int argc, char *argv[]) {
   case 9:
     image_gen = new VolumeBars(canvas, scroll_ms, canvas->width()/2);
     break;
+
+  case 10:
+    if (demo_parameter) {
+      Playlist *playlist = new Playlist(matrix, demo_parameter,
+                                        max(show_seconds, 1));
+      if (!playlist->Init())
+        return 1;
+      image_gen = playlist;
+    } else {
+      fprintf(stderr, "Demo %d Requires a directory as parameter\n", demo);
+      return 1;
+    }
+    break;
   }
 
   if (image_gen == NULL)
@@ -1083,6 +1504,18 @@ int main(int argc, char *argv[]) {
   // Image generating demo is crated. Now start the thread.
   image_gen->Start();
 
+  StatisticsWriter *statistics_writer = NULL;
+  if (statistics_file) {
+    FILE *out = (strcmp(statistics_file, "-") == 0
+                 ? stderr : fopen(statistics_file, "a"));
+    if (out == NULL) {
+      perror("Opening statistics file");
+    } else {
+      statistics_writer = new StatisticsWriter(matrix, out);
+      statistics_writer->Start();
+    }
+  }
+
   // Now, the image genreation runs in the background. We can do arbitrary
   // things here in parallel. In this demo, we're essentially just
   // waiting for one of the conditions to exit.
@@ -1096,6 +1529,8 @@ int main(int argc, char *argv[]) {
     getchar();
   }
 
+  delete statistics_writer;
+
   // Stop image generating thread.
   delete image_gen;
   delete canvas;
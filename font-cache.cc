@@ -0,0 +1,27 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Precompile a BDF font into a font cache file, which Font::LoadFont()
+// memory-maps instead of parsing it.
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "graphics.h"
+
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <bdf-font-file> <cache-file>\n", argv[0]);
+    return 1;
+  }
+  rgb_matrix::Font font;
+  if (!font.LoadFont(argv[1])) {
+    fprintf(stderr, "Couldn't load font '%s'\n", argv[1]);
+    return 1;
+  }
+  if (!font.SaveCache(argv[2])) {
+    perror(argv[2]);
+    return 1;
+  }
+  return 0;
+}
@@ -41,6 +41,45 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // Set a rectangle of "width" x "height" pixels with its top left corner
+  // at (x,y) from 24bpp data: one byte each for red, green and blue per
+  // pixel. "stride" is the number of bytes from the start of one row in
+  // "rgb_data" to the next. Parts outside the canvas are clipped.
+  // The default implementation just calls SetPixel() for each pixel;
+  // the RGBMatrix converts whole rows at once, so if you have a block of
+  // pixels (e.g. an image) this is much faster.
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb_data, int stride) {
+    for (int row = 0; row < height; ++row, rgb_data += stride) {
+      const uint8_t *pixel = rgb_data;
+      for (int col = 0; col < width; ++col, pixel += 3) {
+        SetPixel(x + col, y + row, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+
+  // Set the pixels of a one bit per pixel bitmap of "width" (at most 32) x
+  // "height" pixels with its top left corner at (x,y), e.g. a glyph of a
+  // font. Row "r" is "rows[r]", with the leftmost pixel in the highest bit.
+  // Pixels with their bit set get the "foreground" color, the others the
+  // "background" color, or are left alone if "background" is NULL. Colors
+  // are 3 bytes: red, green and blue. Parts outside the canvas are clipped.
+  // The default implementation just calls SetPixel() for each pixel; the
+  // RGBMatrix works out where each row goes only once and writes the
+  // bitplanes of its pixels directly.
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         const uint8_t *foreground,
+                         const uint8_t *background) {
+    for (int row = 0; row < height; ++row) {
+      uint32_t mask = 0x80000000;
+      for (int col = 0; col < width && col < 32; ++col, mask >>= 1) {
+        const uint8_t *color = (rows[row] & mask) ? foreground : background;
+        if (color) SetPixel(x + col, y + row, color[0], color[1], color[2]);
+      }
+    }
+  }
 };
 
 }  // namespace rgb_matrix
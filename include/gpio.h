@@ -21,8 +21,41 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+// Where the matrix output goes to. The real thing is the GPIO below; other
+// implementations can e.g. record what is written (see simulated-gpio.h), so
+// that the output can be tested and measured without a Raspberry Pi.
+class OutputBackend {
+ public:
+  virtual ~OutputBackend() {}
+
+  // Initialize outputs.
+  // Returns the bits that are actually set.
+  virtual uint32_t InitOutputs(uint32_t outputs) = 0;
+
+  // Set the bits that are '1' in the output. Leave the rest untouched.
+  virtual void SetBits(uint32_t value) = 0;
+
+  // Clear the bits that are '1' in the output. Leave the rest untouched.
+  virtual void ClearBits(uint32_t value) = 0;
+
+  // Keep the output as it is for the given time. This is how long the LEDs
+  // of a bitplane are switched on.
+  // Returns the time actually passed, as far as the backend can tell.
+  virtual long SleepNanos(long nanos) = 0;
+
+  // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
+  }
+};
+
+// The GPIO pins of the Raspberry Pi, accessed via /dev/mem.
 // For now, everything is initialized as output.
-class GPIO {
+// The refresh loop calls the methods of this class without going through the
+// virtual functions, so don't derive from it to intercept the output; derive
+// from OutputBackend instead.
+class GPIO : public OutputBackend {
  public:
   // Available bits that actually have pins.
   static const uint32_t kValidBits;
@@ -31,35 +64,48 @@ class GPIO {
 
   // Initialize before use. Returns 'true' if successful, 'false' otherwise
   // (e.g. due to a permission problem).
+  // This also calibrates the timing of SleepNanos(), which takes a few
+  // milliseconds.
   bool Init();
 
   // Initialize outputs.
   // Returns the bits that are actually set.
-  uint32_t InitOutputs(uint32_t outputs);
+  virtual uint32_t InitOutputs(uint32_t outputs);
 
   // Set the bits that are '1' in the output. Leave the rest untouched.
-  inline void SetBits(uint32_t value) {
+  virtual void SetBits(uint32_t value) {
     gpio_port_[0x1C / sizeof(uint32_t)] = value;
   }
 
   // Clear the bits that are '1' in the output. Leave the rest untouched.
-  inline void ClearBits(uint32_t value) {
+  virtual void ClearBits(uint32_t value) {
     gpio_port_[0x28 / sizeof(uint32_t)] = value;
   }
 
+  // Wait until "nanos" have passed on the monotonic clock. Long waits are
+  // mostly spent in nanosleep(), the rest is busy waiting. Returns the
+  // time actually passed.
+  virtual long SleepNanos(long nanos);
+
   // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
   inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
     // Writing a word is two operations. The IO is actually pretty slow, so
     // this should probably  be unnoticable.
-    ClearBits(~value & mask);
-    SetBits(value & mask);
+    GPIO::ClearBits(~value & mask);
+    GPIO::SetBits(value & mask);
   }
 
   inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
 
  private:
+  // Measure how much nanosleep() oversleeps, to know when it is worthwhile.
+  void CalibrateSleep();
+
   uint32_t output_bits_;
   volatile uint32_t *gpio_port_;
+
+  long sleep_overshoot_nanos_;  // Typical extra time nanosleep() takes.
+  long min_sleep_nanos_;        // Below this, only busy wait.
 };
 }  // end namespace rgb_matrix
 #endif  // RPI_GPIO_H
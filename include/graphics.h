@@ -9,8 +9,12 @@
 
 #include "canvas.h"
 
-#include <map>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <string>
 
 namespace rgb_matrix {
 struct Color {
@@ -22,14 +26,24 @@ struct Color {
 
 // Font loading bdf files. If this ever becomes more types, just make virtual
 // base class.
+// Fonts can also be loaded from a precompiled cache file (see SaveCache()),
+// which is memory-mapped instead of parsed, so loading costs next to nothing.
 class Font {
 public:
   // Initialize font, but it is only usable after LoadFont() has been called.
   Font();
   ~Font();
 
+  // Load a BDF font or a font cache file written with SaveCache(); the
+  // format is detected from the content.
   bool LoadFont(const char *path);
 
+  // Write the loaded font as cache file to "path". The cache has the byte
+  // order of this machine. An existing file is replaced as a whole, so
+  // programs that have loaded it are not disturbed. Returns false if no
+  // font is loaded or the file can't be written.
+  bool SaveCache(const char *path) const;
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -48,24 +62,123 @@ public:
   // character or 0 if we didn't draw any chracter.
   int DrawGlyph(Canvas *c, int x, int y, const Color &color,
                 uint32_t unicode_codepoint) const;
+
+  // Same, but also fills the character cell (width of the character x
+  // height of the font) with "background_color" if it is not NULL, so
+  // that it replaces whatever was there.
+  int DrawGlyph(Canvas *c, int x, int y, const Color &color,
+                const Color *background_color,
+                uint32_t unicode_codepoint) const;
+
+  // Draw the "count" characters in "codepoints" next to each other, the
+  // same way. Returns how far we advance on the screen.
+  int DrawGlyphs(Canvas *c, int x, int y, const Color &color,
+                 const Color *background_color,
+                 const uint32_t *codepoints, int count) const;
 private:
+  Font(const Font &);  // Not copyable.
+  Font &operator=(const Font &);
+
+  struct CacheHeader;
   struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+
+  bool LoadBDF(FILE *f);
+  bool MapCache(int fd);
+
+  // Point the lookup tables into "data", which has the cache format.
+  // Returns false if it is not valid; then, nothing is changed.
+  bool UseData(const char *data, size_t size);
+  void Release();  // Free data_; the lookup tables still point into it.
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  void DrawGlyph(Canvas *c, int x, int y, const uint8_t *foreground,
+                 const uint8_t *background, const Glyph *g) const;
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // The font in the cache format (see bdf-font.cc): either parsed from a
+  // BDF file into allocated memory or a memory-mapped cache file.
+  char *data_;
+  size_t size_;
+  bool mapped_;
+  const uint32_t *direct_index_;  // Glyph index of codepoints < 256.
+  const Glyph *glyphs_;           // Sorted by codepoint.
+  uint32_t glyph_count_;
+  const uint32_t *bitmaps_;       // The rows of all glyphs.
 };
 
 // -- Some utility functions.
 
 // Draw text, encoded in UTF-8, with given "font" at "x","y" with "color".
+// Malformed UTF-8 is drawn as replacement character "�".
 // Returns how far we advance on the screen.
 int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color,
              const char *utf8_text);
 
+// Same, with the background of the characters filled with
+// "background_color", unless it is NULL.
+int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color,
+             const Color *background_color, const char *utf8_text);
+
+// Text rendered once into a strip of one bit per pixel, as high as the font,
+// to be scrolled across a canvas: drawing the visible part of the strip
+// costs the same, no matter how long the text is. Text can be appended at
+// any time and the columns that have scrolled past discarded, so e.g. a
+// ticker fed from a pipe only keeps what is still to be shown.
+class TextStrip {
+public:
+  // The "font" needs to be loaded and has to stay around as long as text is
+  // appended.
+  explicit TextStrip(const Font &font);
+
+  // Render text, encoded in UTF-8, at the end of the strip. A character
+  // that is cut off at the end of the text is completed with the next
+  // Append(), so text can be appended as it is read.
+  void Append(const char *utf8_text);
+  void Append(const char *utf8_text, size_t len);
+
+  // Add "pixels" empty columns at the end of the strip.
+  void AppendSpace(int pixels);
+
+  // Width of the strip in pixels, which is the width of the text: e.g. to
+  // center it without drawing.
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Remove the first "columns" columns of the strip (at most all of them),
+  // e.g. when they have scrolled past. The remaining columns start at 0.
+  void Discard(int columns);
+
+  // Draw the strip, starting with its column "offset", at "x","y" to the
+  // right edge of the canvas. Like with DrawText(), "y" is the baseline.
+  // The text is drawn with "color"; if "background_color" is not NULL, the
+  // rest of the strip's height is filled with it, also left and right of
+  // the text (where "offset" is negative or beyond width()).
+  void Draw(Canvas *c, int x, int y, int offset, const Color &color,
+            const Color *background_color = NULL) const;
+
+private:
+  class Renderer;
+
+  void Grow(int columns);  // Make room for "columns" columns.
+
+  // 32 columns of the strip starting at "column", from the highest bit;
+  // columns outside the strip are 0.
+  uint32_t Columns(int column, int row) const;
+
+  // The bits in chunks of 32 columns: "height_" rows of each, the leftmost
+  // column in the highest bit. Column 0 of the strip is bit "first_" of the
+  // first chunk.
+  std::deque<uint32_t> bits_;
+  int first_;
+
+  const Font &font_;
+  const int height_;
+  int width_;
+  std::string pending_;  // Incomplete UTF-8 character at the end.
+};
+
 // lines, circles and stuff.
 
 }  // namespace rgb_matrix
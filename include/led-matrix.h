@@ -19,25 +19,129 @@
 #define RPI_RGBMATRIX_H
 
 #include <stdint.h>
+#include <vector>
+
 #include "gpio.h"
 #include "canvas.h"
+#include "pixel-mapper.h"
+#include "thread.h"
 
 namespace rgb_matrix {
+class FrameCanvas;
+class BitplaneImage;
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 class RGBMatrix : public Canvas {
 public:
+  // How the frame buffers keep their bitplanes in memory.
+  enum BitplaneLayout {
+    // A complete GPIO word per column and bitplane, ready to be written out.
+    kFullWordBitplanes,
+
+    // Only the six color bits per column and bitplane, in one byte; they are
+    // expanded to the GPIO word with a small table while writing out.
+    // Needs a quarter of the memory, which helps with long chains, as the
+    // whole buffer is read on every refresh.
+    kPackedBitplanes
+  };
+
+  // How the pixels of a panel are wired to the shift registers and row
+  // addresses.
+  enum Multiplexing {
+    // The common indoor panels: the upper and lower half of the panel are
+    // shown at the same time, so there are rows / 2 row addresses (1:16
+    // scan for 32 rows, 1:32 scan for 64 rows).
+    kDirectMultiplexing,
+
+    // Outdoor panels with 1:4 scan (16 rows) or 1:8 scan (32 rows): each
+    // row address lights four rows, and the shift registers of a panel are
+    // twice as long as it is wide. In each half of the panel, the upper
+    // quarter is clocked in after the lower one.
+    kStripeMultiplexing,
+
+    // Same scan, but the shift registers zig-zag through the upper and
+    // lower quarter in blocks of 16 columns.
+    kCheckeredMultiplexing
+  };
+
+  // Parameters of the matrix that can only be set at construction time.
+  struct Options {
+    Options();  // Sets the defaults.
+
+    int rows;              // Rows of one display: 16, 32 or 64. Default: 32.
+    int chained_displays;  // Number of daisy-chained displays. Default: 1.
+
+    // Number of chains connected in parallel, 1 to 3. They are clocked in
+    // at the same time, so this gives more pixels at the same refresh rate
+    // as a single chain. The chains are stacked on top of each other: the
+    // second chain starts at y = rows. The second and third chain need the
+    // pins of the 40 pin header (see README). Default: 1.
+    int parallel_chains;
+    BitplaneLayout bitplane_layout;  // Default: kFullWordBitplanes.
+    Multiplexing multiplexing;       // Default: kDirectMultiplexing.
+
+    // How the panels are arranged on the wall, in the format described in
+    // pixel-mapper.h, e.g. "serpentine 2x2", or "@" followed by the name of
+    // a file with the description, e.g. "@/etc/wall.panels". The canvas
+    // then has the size of the wall. If it is not valid, the problem is
+    // printed to stderr and the panels are shown as they are chained. Only
+    // used in the constructor. Default: NULL, the panels as they are
+    // chained.
+    const char *panel_arrangement;
+
+    // On-time of the least significant bitplane in nanoseconds; every
+    // further bitplane is shown twice as long as the previous one. Lower
+    // values give a higher refresh rate, but the shortest planes might not
+    // be shown accurately anymore (see GetBitplaneTiming()). Default: 200.
+    long bitplane_base_nanos;
+
+    // CPU to pin the refresh thread to, or -1 to let it float. The CPU is
+    // reserved, so that ThreadedCanvasManipulators run on the others. It
+    // works best if it is excluded from the scheduler with the isolcpus=
+    // kernel parameter. Default: the last CPU if there are several,
+    // otherwise -1.
+    int refresh_cpu;
+
+    // Keep a copy of the pixels (3 bytes per pixel), so that SetPixel() and
+    // SetPixels() skip rows that don't change; these are neither converted
+    // nor checked again for bitplanes that need not be clocked in. Saves a
+    // lot of CPU with content that doesn't change much, e.g. signs.
+    // Default: false.
+    bool optimize_static_content;
+
+    // Keep all 11 bitplanes even if fewer PWM bits are shown, and show the
+    // ones below the PWM bits in turns, one per refresh. Over a few
+    // refreshes, that gives the full color depth with the refresh rate of
+    // one PWM bit more, e.g. for smooth gradients on long chains. Default:
+    // false.
+    bool temporal_dithering;
+  };
+
   // Initialize RGB matrix with GPIO to write to. The "rows" are the number
-  // of rows supported by the display, so 32 or 16. Number of "chained_display"s
-  // tells many of these are daisy-chained together.
+  // of rows supported by the display, so 64, 32 or 16. Number of
+  // "chained_display"s tells many of these are daisy-chained together.
+  // "parallel_chains" is the number of such chains connected in parallel
+  // (see Options).
   // If "io" is not NULL, starts refreshing the screen immediately; you can
   // defer that by setting GPIO later with SetGPIO().
-  RGBMatrix(GPIO *io, int rows = 32, int chained_displays = 1);
+  // Usually, "io" is the GPIO, but it can be any OutputBackend, e.g. a
+  // SimulatedGPIO; the refresh thread only gets realtime priority with GPIO.
+  RGBMatrix(OutputBackend *io, int rows = 32, int chained_displays = 1,
+            int parallel_chains = 1);
+
+  // Same, with all the Options.
+  RGBMatrix(OutputBackend *io, const Options &options);
   virtual ~RGBMatrix();
 
   // Set GPIO output if it was not set already in constructor (oterwise: no-op).
   // Starts display refresh thread if this is the first setting.
-  void SetGPIO(GPIO *io);
+  void SetGPIO(OutputBackend *io);
+
+  // The CPU the refresh thread is pinned to (see Options::refresh_cpu), or
+  // -1 if it is not pinned, e.g. because it is not running yet or pinning
+  // failed.
+  int refresh_cpu() const;
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
@@ -49,6 +153,134 @@ public:
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
 
+  // Set the brightness in percent (0..100). Default is 100. Dims the display
+  // by shortening the time the LEDs are on, so this costs no CPU and keeps
+  // the full color depth. Can be called any time, from any thread.
+  // Returns boolean to signify if value was within range.
+  bool SetBrightness(uint8_t percent);
+  uint8_t brightness();
+
+  // -- Scan-out transformation.
+
+  // These are applied by the refresh thread while clocking the pixels in,
+  // so they cost no CPU and leave the frames as they are. Changes take
+  // effect with the next full refresh, so the display never tears. They
+  // apply to all frames, and can be called any time, from any thread.
+  // They return false if the panels are arranged or multiplexed, which
+  // moves pixels to other columns; then nothing is changed.
+
+  // Show column (x + "column_offset") of the frame at column x, wrapping
+  // around at the end of the chain: e.g. to scroll content exactly as wide
+  // as the display without drawing it again. Any value is fine, it is
+  // taken modulo the width.
+  bool SetScanOffset(int column_offset);
+  int scan_offset();
+
+  // Mirror the display horizontally (left to right) and/or vertically
+  // (upside down), after the offset. Both together turn it by 180 degrees,
+  // e.g. for panels mounted upside down. Parallel chains are each mirrored
+  // in place.
+  bool SetScanMirror(bool horizontal, bool vertical);
+
+  // -- Statistics.
+
+  // Statistics about the refresh, collected all the time by the refresh
+  // thread. All times are in nanoseconds and summed up since the start.
+  struct RefreshStatistics {
+    enum {
+      kBitplanes = 11,
+      // Refresh rates in steps of kHistogramBucketHz; the last bucket
+      // counts everything above.
+      kHistogramBuckets = 32,
+      kHistogramBucketHz = 50
+    };
+
+    uint64_t frames;          // Full refreshes of the display.
+    uint64_t frames_swapped;  // New frames picked up from SwapOnVSync().
+    uint64_t frames_dropped;  // Frames passed to SwapOnVSync() that were
+                              // replaced by another one before being shown.
+    uint64_t refresh_hz_histogram[kHistogramBuckets];
+
+    // Fastest and slowest refresh; the difference is the worst-case jitter.
+    int64_t min_frame_nanos;
+    int64_t max_frame_nanos;
+
+    // Where the time went: clocking in pixels vs. LEDs being lit vs.
+    // bitplanes kept dark, because of the brightness or because none of
+    // their LEDs is on. The lit and dark times are what the output reports;
+    // with outputs that don't really sleep, such as the SimulatedGPIO, it is
+    // simulated time.
+    int64_t clock_in_nanos;
+    int64_t display_nanos;
+    int64_t dark_nanos;
+
+    // Bitplanes without any LED on are not clocked in, so the refresh rate
+    // depends on the content. Frames and their total time by the most
+    // bitplanes clocked in for a row of the frame (0..kBitplanes); the
+    // refresh rate of such content is frames / time.
+    uint64_t frames_by_planes[kBitplanes + 1];
+    int64_t frame_nanos_by_planes[kBitplanes + 1];
+
+    // Sum of the differences of actual and intended on-time for each
+    // bitplane, and how often it was shown.
+    int64_t bitplane_error_nanos[kBitplanes];
+    uint64_t bitplane_count[kBitplanes];
+  };
+
+  // Get a consistent snapshot of the statistics. This never blocks the
+  // refresh thread. Returns false if there is no refresh thread (yet).
+  bool GetRefreshStatistics(RefreshStatistics *stats);
+
+  // How accurate the bitplanes are shown, as measured by the output while
+  // refreshing. For bitplane "plane" (0..10, 0 is the least significant),
+  // returns the intended on-time and the average error of the actual
+  // on-time, both in nanoseconds; a positive error means the plane was lit
+  // too long. Returns false if the plane has not been shown yet.
+  bool GetBitplaneTiming(int plane, long *intended_nanos,
+                         long *mean_error_nanos);
+
+  // -- Double buffering.
+
+  // Create a new buffer to be used for double buffering. Draw into it while
+  // another buffer is being displayed, then make it visible with
+  // SwapOnVSync(). The FrameCanvas is owned by the RGBMatrix and deleted
+  // when the matrix is deleted, so don't delete it yourself.
+  // New canvases inherit the current PWM bits, luminance correction,
+  // brightness and scan-out transformation, even if another thread is
+  // changing them at the same time.
+  FrameCanvas *CreateFrameCanvas();
+
+  // Show "other" from the next full refresh on. This blocks until the
+  // refresh thread has finished clocking out the current frame, then swaps
+  // the pointers; no pixels are copied, so the frame is always shown as a
+  // whole.
+  // Returns the FrameCanvas that was shown before, which is now free to be
+  // drawn into for the next frame. If "other" is NULL, this just waits for
+  // the next vertical sync and returns the current frame; a frame another
+  // thread is swapping in is still shown.
+  // After the call, the Canvas methods of the RGBMatrix write to "other".
+  FrameCanvas *SwapOnVSync(FrameCanvas *other);
+
+  // -- Images in bitplanes.
+
+  // Create a canvas "width" pixels wide and as high as the matrix that is
+  // kept in bitplanes like a FrameCanvas, with the current PWM bits and
+  // luminance correction. Draw into it once, then show parts of it with
+  // CopyColumns() as often as needed: that copies the bitplanes without
+  // any color conversion, e.g. to scroll a wide image. It needs about 22
+  // bytes per pixel (5.5 with kPackedBitplanes, plus 3 with
+  // Options::optimize_static_content). Returns NULL if the panels are
+  // arranged or multiplexed, which moves pixels to other columns.
+  // You own the image: delete it when done.
+  BitplaneImage *CreateBitplaneImage(int width);
+
+  // Show the "width" columns from column "image_x" of "image" from column
+  // "x" of the active FrameCanvas, all rows. Returns false if "image" was
+  // created with fewer PWM bits or a different luminance correction than
+  // the frame uses; then nothing is copied.
+  bool CopyColumns(const BitplaneImage *image, int image_x, int x,
+                   int width);
+
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
   virtual int width() const;
@@ -57,19 +289,112 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb_data, int stride);
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         const uint8_t *foreground,
+                         const uint8_t *background);
 
 private:
   class Framebuffer;
   class UpdateThread;
   friend class UpdateThread;
   friend class FrameCanvas;
+  friend class BitplaneImage;
 
-  // Updates the screen regularly.
-  void UpdateScreen();
+  void Init(OutputBackend *io, const Options &options);
+  Framebuffer *CreateFramebuffer() const;
 
-  Framebuffer *frame_;
-  GPIO *io_;
+  Options options_;              // As passed, but panel_arrangement is
+  PixelMapper *mapper_;          // compiled to mapper_ (or NULL).
+  FrameCanvas *active_;          // The frame shown and written to.
+  OutputBackend *io_;
+  int refresh_cpu_;              // Requested in Options, -1 for none.
+  bool refresh_cpu_pinned_;
   UpdateThread *updater_;
+  // Settings go to all frames; this keeps a frame from being added while
+  // they are changed from another thread.
+  Mutex frames_mutex_;
+  std::vector<FrameCanvas*> created_frames_;
+};
+
+// A frame buffer you can draw into, while another one is being displayed.
+// Get one from RGBMatrix::CreateFrameCanvas() and show it with
+// RGBMatrix::SwapOnVSync().
+class FrameCanvas : public Canvas {
+public:
+  // Set PWM bits used for this frame. See RGBMatrix::SetPWMBits().
+  bool SetPWMBits(uint8_t value);
+  uint8_t pwmbits();
+
+  // Whether anything in this frame changed since it was last written to the
+  // display. With Options::optimize_static_content, writing the same
+  // pixels again is not a change.
+  bool HasChanges() const;
+
+  // Write this frame once to "output". The refresh thread of the RGBMatrix
+  // does this continuously; calling it directly is useful to drive an
+  // output synchronously, e.g. a SimulatedGPIO in tests or benchmarks.
+  // Don't use it with the output the refresh thread is writing to.
+  void DumpToMatrix(OutputBackend *output);
+
+  // Copy columns of "image" to this frame. See RGBMatrix::CopyColumns().
+  bool CopyColumns(const BitplaneImage *image, int image_x, int x,
+                   int width);
+
+  // -- Canvas interface.
+  virtual int width() const;
+  virtual int height() const;
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb_data, int stride);
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         const uint8_t *foreground,
+                         const uint8_t *background);
+
+private:
+  friend class RGBMatrix;
+
+  // Only the RGBMatrix creates and deletes these.
+  FrameCanvas(RGBMatrix::Framebuffer *frame) : frame_(frame) {}
+  virtual ~FrameCanvas();
+  RGBMatrix::Framebuffer *framebuffer() { return frame_; }
+
+  RGBMatrix::Framebuffer *const frame_;
+};
+
+// A canvas of any width in bitplanes, to be shown in parts with
+// RGBMatrix::CopyColumns(). Get one from RGBMatrix::CreateBitplaneImage().
+class BitplaneImage : public Canvas {
+public:
+  virtual ~BitplaneImage();
+
+  // -- Canvas interface.
+  virtual int width() const;
+  virtual int height() const;
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb_data, int stride);
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         const uint8_t *foreground,
+                         const uint8_t *background);
+
+private:
+  friend class RGBMatrix;
+  friend class FrameCanvas;
+
+  BitplaneImage(RGBMatrix::Framebuffer *frame) : frame_(frame) {}
+
+  RGBMatrix::Framebuffer *const frame_;
 };
 }  // end namespace rgb_matrix
 #endif  // RPI_RGBMATRIX_H
@@ -0,0 +1,89 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Mapping of the pixels of a wall of panels to the chains they are
+// connected to. The arrangement of the panels is described in a little
+// text format and compiled once into a table, so the mapping costs the same
+// for any arrangement. Usually, you just pass the description, or the name
+// of a file with it, to the RGBMatrix (see
+// RGBMatrix::Options::panel_arrangement), which uses the table directly
+// when setting pixels.
+//
+// The description is a list of panels in the order they are connected,
+// separated by whitespace, ';' or newlines ('#' comments to the end of the
+// line). Each panel is
+//   <column>,<row>[:<transform>]
+// with the position on the wall in panels, (0,0) being the top left.
+// The transform is how the panel is mounted: R90, R180 or R270 to rotate it
+// clockwise, M to mirror it left to right, or both, e.g. MR90 (mirrored
+// first). Rotation by 90 or 270 degrees needs square panels.
+// The first panels are on the first chain, continuing on the next parallel
+// chain.
+//
+// For the common arrangements, there are shortcuts:
+//   serpentine <columns>x<rows>
+//     The chain goes left to right through the top row of panels, then
+//     right to left through the next row with the panels upside down, and
+//     so on. E.g. four panels folded to a square are "serpentine 2x2".
+//   rows <columns>x<rows>
+//     Left to right through each row, top to bottom.
+#ifndef RPI_PIXEL_MAPPER_H
+#define RPI_PIXEL_MAPPER_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace rgb_matrix {
+class PixelMapper {
+public:
+  // Maps nothing before Parse() or LoadFile() succeeded.
+  PixelMapper();
+
+  // Compile the panel arrangement "spec" for the panels of 32 x "rows"
+  // pixels on "parallel_chains" chains of "chained_displays" panels.
+  // Returns false if "spec" is not valid or does not fit the chains; the
+  // reason is printed to stderr.
+  bool Parse(const char *spec,
+             int rows, int chained_displays, int parallel_chains = 1);
+
+  // Same, reading the description from the file at "path".
+  bool LoadFile(const char *path,
+                int rows, int chained_displays, int parallel_chains = 1);
+
+  // Size of the wall.
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Position of the pixel (x, y) of the wall on the chains, in the
+  // coordinates of an RGBMatrix without arrangement. Returns false if
+  // there is no panel at (x, y).
+  bool Map(int x, int y, int *matrix_x, int *matrix_y) const {
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return false;
+    const uint32_t entry = table_[y * width_ + x];
+    if (entry == kNoPanel) return false;
+    *matrix_x = entry & 0xffff;
+    *matrix_y = entry >> 16;
+    return true;
+  }
+
+private:
+  static const uint32_t kNoPanel = 0xffffffff;
+
+  int width_;
+  int height_;
+  std::vector<uint32_t> table_;  // matrix_y << 16 | matrix_x, row by row.
+};
+}  // namespace rgb_matrix
+#endif  // RPI_PIXEL_MAPPER_H
@@ -0,0 +1,115 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// An OutputBackend that does not need a Raspberry Pi: it records what is
+// written and simulates the shift registers and latches of a chain of panels,
+// so that the output of the library can be tested and measured on any
+// Linux box.
+#ifndef RPI_SIMULATED_GPIO_H
+#define RPI_SIMULATED_GPIO_H
+
+#include <stdint.h>
+
+#include "gpio.h"
+
+namespace rgb_matrix {
+class SimulatedGPIO : public OutputBackend {
+public:
+  // One output operation, as recorded in the history.
+  struct Operation {
+    enum Type { kSetBits, kClearBits, kSleep };
+    Type type;
+    uint32_t value;  // Bits for kSetBits/kClearBits, nanoseconds for kSleep.
+  };
+
+  // Simulate a chain of panels with "rows" rows (16, 32 or 64) and "columns"
+  // columns (32 * number of chained panels). For panels with a
+  // RGBMatrix::Multiplexing other than kDirectMultiplexing, this is the size
+  // as it is scanned out: half the rows, twice the columns; the image is
+  // decoded as such. The last "history_size"
+  // operations are kept. With "parallel_chains" > 1, each chain is decoded
+  // separately; they are stacked on top of each other in the image, like in
+  // the RGBMatrix.
+  SimulatedGPIO(int rows, int columns, int history_size = 4096,
+                int parallel_chains = 1);
+  virtual ~SimulatedGPIO();
+
+  // -- OutputBackend interface.
+  virtual uint32_t InitOutputs(uint32_t outputs);
+  virtual void SetBits(uint32_t value);
+  virtual void ClearBits(uint32_t value);
+
+  // Does not actually sleep, but advances the simulated time. While the
+  // output is enabled, this is the time the latched pixels are lit.
+  // Returns "nanos": the simulated timing is always exact.
+  virtual long SleepNanos(long nanos);
+
+  // -- Decoded panel image.
+
+  // Time in nanoseconds the red, green and blue LEDs of the pixel at (x, y)
+  // (0 <= y < rows * parallel_chains)
+  // have been lit since creation or the last ResetImage(). For a single
+  // frame, this is the color value after luminance correction, multiplied by
+  // the base time of the lowest bitplane.
+  void GetOnTime(int x, int y,
+                 uint64_t *red, uint64_t *green, uint64_t *blue) const;
+
+  // Set all on-times to zero, e.g. before dumping a frame.
+  void ResetImage();
+
+  // Sum of all sleeps so far.
+  uint64_t elapsed_nanos() const { return elapsed_nanos_; }
+
+  // -- Recorded operations.
+
+  // Number of SetBits() and ClearBits() calls so far.
+  uint64_t write_count() const { return write_count_; }
+
+  // Number of operations currently available in the history, and the
+  // operation at "index", 0 being the oldest.
+  int history_size() const;
+  const Operation &history(int index) const;
+
+private:
+  void Record(Operation::Type type, uint32_t value);
+  void ClockIn();  // Rising clock edge.
+  void Latch();    // Rising strobe edge.
+
+  const int rows_;
+  const int columns_;
+  const int double_rows_;
+  const int parallel_;
+
+  uint32_t outputs_;        // Bits initialized with InitOutputs().
+  uint32_t state_;          // Current level of all bits.
+
+  // Shift registers of the chains: six color bits (r1, g1, b1, r2, g2, b2
+  // from lowest bit up) per column and chain, the first chain in the lowest
+  // bits. It is a ring; shift_pos_ is where the next column is clocked in,
+  // which is also the oldest one.
+  uint32_t *shift_register_;
+  int shift_pos_;
+  uint32_t *latch_;         // Column data latched with the last strobe.
+
+  uint64_t *on_time_;       // rows x parallel x columns x (red, green, blue)
+  uint64_t elapsed_nanos_;
+
+  Operation *history_;
+  const int history_capacity_;
+  uint64_t write_count_;
+  uint64_t recorded_count_;  // All operations, including sleeps.
+};
+}  // end namespace rgb_matrix
+#endif  // RPI_SIMULATED_GPIO_H
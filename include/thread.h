@@ -17,6 +17,7 @@
 #define RPI_THREAD_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 namespace rgb_matrix {
 // Simple thread abstraction.
@@ -31,14 +32,32 @@ public:
   void WaitStopped();
 
   // Start thread. If realtime_priority is > 0, then this will be a
-  // thread with SCHED_FIFO and the given priority.
-  void Start(int realtime_priority = 0);
+  // thread with SCHED_FIFO and the given priority. If affinity_mask is not
+  // 0, the thread only runs on the CPUs whose bit is set.
+  // Returns false (after printing why) if the priority or affinity could
+  // not be set; the thread is running anyway.
+  bool Start(int realtime_priority = 0, uint32_t affinity_mask = 0);
+
+  // Restrict a started thread to the CPUs in "affinity_mask". Returns false
+  // (after printing why) if that failed.
+  bool SetAffinity(uint32_t affinity_mask);
+
+  // -- CPUs reserved for time-critical threads, such as the refresh thread
+  // of the RGBMatrix. Threads that just produce content, such as the
+  // ThreadedCanvasManipulator, keep off them by default.
+  static void ReserveCpu(int cpu);
+  static void ReleaseCpu(int cpu);
+
+  // Mask of all online CPUs that are not reserved. If that would leave
+  // nothing, all online CPUs.
+  static uint32_t UnreservedCpus();
 
   // Override this.
   virtual void Run() = 0;
 
 private:
   static void *PthreadCallRun(void *tobject);
+  static uint32_t reserved_cpus_;
   bool started_;
   pthread_t thread_;
 };
@@ -51,6 +70,11 @@ public:
   void Lock() { pthread_mutex_lock(&mutex_); }
   void Unlock() { pthread_mutex_unlock(&mutex_); }
   void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
+  // Same, but give up at "deadline" (on the clock of "cond"). Returns 0 or
+  // ETIMEDOUT.
+  int WaitOn(pthread_cond_t *cond, const struct timespec &deadline) {
+    return pthread_cond_timedwait(cond, &mutex_, &deadline);
+  }
 
 private:
   pthread_mutex_t mutex_;
@@ -65,6 +89,33 @@ private:
   Mutex *const mutex_;
 };
 
+// Lets one thread ask another one to stop. Checking is lock-free, so it is
+// cheap enough to be done in every loop iteration, even in a realtime
+// thread. A thread waiting in SleepMillis() wakes up as soon as Stop() is
+// called.
+class StopRequest {
+public:
+  StopRequest();
+  ~StopRequest();
+
+  // Request to stop. Can be called from any thread.
+  void Stop();
+
+  // Has Stop() been called ?
+  inline bool stopped() const {
+    return __atomic_load_n(&stopped_, __ATOMIC_ACQUIRE);
+  }
+
+  // Sleep for the given time, or until Stop() is called, whatever comes
+  // first. Returns true if we should keep running, i.e. !stopped().
+  bool SleepMillis(long milliseconds);
+
+private:
+  bool stopped_;
+  Mutex mutex_;
+  pthread_cond_t wakeup_;
+};
+
 }  // end namespace rgb_matrix
 
 #endif  // RPI_THREAD_H
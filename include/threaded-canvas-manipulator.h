@@ -41,7 +41,7 @@ namespace rgb_matrix {
             canvas()->SetPixel(x, y, c, c, c);
           }
         }
-        usleep(15 * 1000);
+        SleepMillis(15);   // Returns early when stopped.
       }
     }
   };
@@ -58,28 +58,38 @@ namespace rgb_matrix {
 */
 class ThreadedCanvasManipulator : public Thread {
 public:
-  ThreadedCanvasManipulator(Canvas *m) : running_(true), canvas_(m) {}
-  virtual ~ThreadedCanvasManipulator() {  Stop(); }
+  ThreadedCanvasManipulator(Canvas *m) : canvas_(m) {}
+  virtual ~ThreadedCanvasManipulator() {
+    Stop();
+    WaitStopped();  // Before stop_ goes away.
+  }
 
-  // Stop the thread at the next possible time Run() checks the running_ flag.
-  void Stop() {
-    MutexLock l(&mutex_);
-    running_ = false;
+  // Start the thread. Unless given an "affinity_mask", it runs on the CPUs
+  // not reserved for the refresh of the matrix (see Thread::ReserveCpu()).
+  bool Start(int realtime_priority = 0, uint32_t affinity_mask = 0) {
+    if (affinity_mask == 0) affinity_mask = Thread::UnreservedCpus();
+    return Thread::Start(realtime_priority, affinity_mask);
   }
 
+  // Stop the thread at the next possible time Run() checks running(). If
+  // Run() is waiting in SleepMillis(), it wakes up immediately.
+  void Stop() { stop_.Stop(); }
+
   // Implement this and run while running() returns true.
   virtual void Run() = 0;
 
 protected:
   inline Canvas *canvas() { return canvas_; }
-  inline bool running() {
-    MutexLock l(&mutex_);
-    return running_;
+  inline bool running() { return !stop_.stopped(); }
+
+  // Use this instead of usleep() in Run() to wait between frames: it
+  // returns early when Stop() is called. Returns running().
+  inline bool SleepMillis(long milliseconds) {
+    return stop_.SleepMillis(milliseconds);
   }
 
 private:
-  Mutex mutex_;
-  bool running_;
+  StopRequest stop_;
   Canvas *const canvas_;
 };
 }  // namespace rgb_matrix
@@ -15,9 +15,17 @@
 
 #include "graphics.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
@@ -26,79 +34,282 @@ static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 // Make wider if running into trouble.
 typedef uint32_t rowbitmap_t;
 
+// The cache format, which is also how a loaded font is kept in memory:
+//   CacheHeader
+//   uint32_t direct_index[kDirectIndexSize]: glyph index or kNoGlyph
+//   Glyph glyphs[glyph_count], sorted by codepoint
+//   rowbitmap_t bitmaps[bitmap_rows]
+// All in the byte order of the machine that wrote it.
+static const uint32_t kCacheMagic = 0x46424752;  // "RGBF" little endian.
+static const uint32_t kCacheVersion = 1;
+static const uint32_t kDirectIndexSize = 256;    // ASCII and Latin-1.
+static const uint32_t kNoGlyph = 0xffffffff;
+
 namespace rgb_matrix {
+struct Font::CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t font_height;
+  int32_t base_line;
+  uint32_t glyph_count;
+  uint32_t bitmap_rows;
+};
+
 struct Font::Glyph {
-  int width, height;
-  int y_offset;
-  rowbitmap_t bitmap[0];  // contains 'height' elements.
+  uint32_t codepoint;
+  int16_t width, height;
+  int16_t y_offset;
+  uint16_t unused;
+  uint32_t bitmap;  // Index of the first of 'height' rows in the bitmaps.
+};
+
+namespace {
+struct CodepointLess {
+  template <class G> bool operator()(const G &a, const G &b) const {
+    return a.codepoint < b.codepoint;
+  }
+  template <class G> bool operator()(const G &a, uint32_t cp) const {
+    return a.codepoint < cp;
+  }
 };
+}  // anonymous namespace
+
+Font::Font()
+  : font_height_(-1), base_line_(0), data_(NULL), size_(0), mapped_(false),
+    direct_index_(NULL), glyphs_(NULL), glyph_count_(0), bitmaps_(NULL) {}
 
-Font::Font() : font_height_(-1) {}
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    free(it->second);
+  Release();
+}
+
+void Font::Release() {
+  if (mapped_) {
+    munmap(data_, size_);
+  } else {
+    free(data_);
   }
+  data_ = NULL;
+  size_ = 0;
+  mapped_ = false;
 }
 
-// TODO: that might not be working for all input files yet.
 bool Font::LoadFont(const char *path) {
   if (!path || !*path) return false;
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
-  uint32_t codepoint;
+  uint32_t magic = 0;
+  const bool is_cache = (fread(&magic, sizeof(magic), 1, f) == 1
+                         && magic == kCacheMagic);
+  rewind(f);
+  const bool success = is_cache ? MapCache(fileno(f)) : LoadBDF(f);
+  fclose(f);
+  return success;
+}
+
+// TODO: that might not be working for all input files yet.
+bool Font::LoadBDF(FILE *f) {
+  int font_height = -1, base_line = 0;
+  std::vector<Glyph> glyphs;
+  std::vector<rowbitmap_t> bitmaps;
+  uint32_t codepoint = 0;
   char buffer[1024];
   int dummy;
+  int width, height, x_offset, y_offset;
+  Glyph *current_glyph = NULL;  // Appended to "glyphs" at ENDCHAR.
   Glyph tmp;
-  Glyph *current_glyph = NULL;
   int row = 0;
-  int x_offset = 0;
   int bitmap_shift = 0;
   while (fgets(buffer, sizeof(buffer), f)) {
-    if (sscanf(buffer, "FONTBOUNDINGBOX %d %d %d %d",
-               &dummy, &font_height_, &dummy, &base_line_) == 4) {
-      base_line_ += font_height_;
+    // Only lines with the right keyword are parsed in full.
+    if (strncmp(buffer, "FONTBOUNDINGBOX ", 16) == 0
+        && sscanf(buffer, "FONTBOUNDINGBOX %d %d %d %d",
+                  &dummy, &font_height, &dummy, &base_line) == 4) {
+      base_line += font_height;
     }
-    else if (sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
+    else if (strncmp(buffer, "ENCODING ", 9) == 0
+             && sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
       // parsed.
     }
-    else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
-                    &x_offset, &tmp.y_offset) == 4) {
-      current_glyph = (Glyph*) malloc(sizeof(Glyph)
-                                      + tmp.height * sizeof(rowbitmap_t));
-      *current_glyph = tmp;
+    else if (strncmp(buffer, "BBX ", 4) == 0
+             && sscanf(buffer, "BBX %d %d %d %d",
+                       &width, &height, &x_offset, &y_offset) == 4) {
+      if (width < 0 || width > (int) (8 * sizeof(rowbitmap_t))
+          || height < 0) {
+        current_glyph = NULL;  // Doesn't fit in a row bitmap; skipped.
+        continue;
+      }
+      tmp.width = width;
+      tmp.height = height;
+      tmp.y_offset = y_offset;
+      tmp.unused = 0;
+      tmp.bitmap = bitmaps.size();
+      bitmaps.resize(bitmaps.size() + height);
+      current_glyph = &tmp;
       // We only get number of bytes large enough holding our width. We want
       // it always left-aligned.
       bitmap_shift =
-        8 * (sizeof(rowbitmap_t) - ((current_glyph->width + 7) / 8)) + x_offset;
+        8 * (sizeof(rowbitmap_t) - ((width + 7) / 8)) + x_offset;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
     else if (current_glyph && row >= 0 && row < current_glyph->height
-             && (sscanf(buffer, "%x", &current_glyph->bitmap[row]) == 1)) {
-      current_glyph->bitmap[row] <<= bitmap_shift;
+             && (sscanf(buffer, "%x",
+                        &bitmaps[current_glyph->bitmap + row]) == 1)) {
+      bitmaps[current_glyph->bitmap + row] <<= bitmap_shift;
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
       if (current_glyph && row == current_glyph->height) {
-        free(glyphs_[codepoint]);  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
+        current_glyph->codepoint = codepoint;
+        glyphs.push_back(*current_glyph);
         current_glyph = NULL;
       }
     }
   }
-  fclose(f);
+
+  // Sorted by codepoint; of the same codepoint, the last one wins.
+  std::stable_sort(glyphs.begin(), glyphs.end(), CodepointLess());
+  size_t unique = 0;
+  for (size_t i = 0; i < glyphs.size(); ++i) {
+    if (unique > 0 && glyphs[unique - 1].codepoint == glyphs[i].codepoint) {
+      glyphs[unique - 1] = glyphs[i];
+    } else {
+      glyphs[unique++] = glyphs[i];
+    }
+  }
+  glyphs.resize(unique);
+
+  const size_t size = (sizeof(CacheHeader)
+                       + kDirectIndexSize * sizeof(uint32_t)
+                       + glyphs.size() * sizeof(Glyph)
+                       + bitmaps.size() * sizeof(rowbitmap_t));
+  char *data = (char*) malloc(size);
+  CacheHeader *header = (CacheHeader*) data;
+  header->magic = kCacheMagic;
+  header->version = kCacheVersion;
+  header->font_height = font_height;
+  header->base_line = base_line;
+  header->glyph_count = glyphs.size();
+  header->bitmap_rows = bitmaps.size();
+  uint32_t *direct_index = (uint32_t*) (header + 1);
+  for (uint32_t cp = 0; cp < kDirectIndexSize; ++cp) {
+    direct_index[cp] = kNoGlyph;
+  }
+  for (size_t i = 0; i < glyphs.size(); ++i) {
+    if (glyphs[i].codepoint < kDirectIndexSize)
+      direct_index[glyphs[i].codepoint] = i;
+  }
+  char *pos = (char*) (direct_index + kDirectIndexSize);
+  if (!glyphs.empty()) memcpy(pos, &glyphs[0], glyphs.size() * sizeof(Glyph));
+  pos += glyphs.size() * sizeof(Glyph);
+  if (!bitmaps.empty()) {
+    memcpy(pos, &bitmaps[0], bitmaps.size() * sizeof(rowbitmap_t));
+  }
+
+  if (!UseData(data, size)) {
+    free(data);
+    return false;
+  }
+  Release();
+  data_ = data;
+  size_ = size;
+  mapped_ = false;
+  return true;
+}
+
+bool Font::MapCache(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader))
+    return false;
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return false;
+  if (!UseData((const char*) data, st.st_size)) {
+    munmap(data, st.st_size);
+    return false;
+  }
+  Release();
+  data_ = (char*) data;
+  size_ = st.st_size;
+  mapped_ = true;
+  return true;
+}
+
+bool Font::UseData(const char *data, size_t size) {
+  const CacheHeader *header = (const CacheHeader*) data;
+  if (size < sizeof(CacheHeader) || header->magic != kCacheMagic
+      || header->version != kCacheVersion)
+    return false;
+  const uint64_t expected_size
+    = (sizeof(CacheHeader) + kDirectIndexSize * sizeof(uint32_t)
+       + (uint64_t) header->glyph_count * sizeof(Glyph)
+       + (uint64_t) header->bitmap_rows * sizeof(rowbitmap_t));
+  if (expected_size != size)
+    return false;
+  const uint32_t *direct_index = (const uint32_t*) (header + 1);
+  const Glyph *glyphs = (const Glyph*) (direct_index + kDirectIndexSize);
+  const rowbitmap_t *bitmaps
+    = (const rowbitmap_t*) (glyphs + header->glyph_count);
+
+  // Don't trust the file: all glyphs must be within the bitmaps, and the
+  // index within the glyphs.
+  for (uint32_t i = 0; i < header->glyph_count; ++i) {
+    const Glyph &g = glyphs[i];
+    if (g.height < 0 || g.width < 0
+        || g.width > (int) (8 * sizeof(rowbitmap_t))
+        || (uint64_t) g.bitmap + g.height > header->bitmap_rows
+        || (i > 0 && glyphs[i - 1].codepoint >= g.codepoint))
+      return false;
+  }
+  for (uint32_t cp = 0; cp < kDirectIndexSize; ++cp) {
+    if (direct_index[cp] != kNoGlyph
+        && (direct_index[cp] >= header->glyph_count
+            || glyphs[direct_index[cp]].codepoint != cp))
+      return false;
+  }
+
+  font_height_ = header->font_height;
+  base_line_ = header->base_line;
+  direct_index_ = direct_index;
+  glyphs_ = glyphs;
+  glyph_count_ = header->glyph_count;
+  bitmaps_ = bitmaps;
+  return true;
+}
+
+bool Font::SaveCache(const char *path) const {
+  if (data_ == NULL) return false;
+  // Written next to it and renamed: programs that have the old file mapped
+  // keep it, while rewriting it in place would kill them with SIGBUS.
+  const std::string tmp_path = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (f == NULL)
+    return false;
+  bool success = (fwrite(data_, size_, 1, f) == 1);
+  success = (fclose(f) == 0) && success;
+  if (!success || rename(tmp_path.c_str(), path) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
   return true;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  if (direct_index_ == NULL)
     return NULL;
-  return found->second;
+  if (unicode_codepoint < kDirectIndexSize) {
+    const uint32_t index = direct_index_[unicode_codepoint];
+    return index == kNoGlyph ? NULL : &glyphs_[index];
+  }
+  const Glyph *end = glyphs_ + glyph_count_;
+  const Glyph *found = std::lower_bound(glyphs_, end, unicode_codepoint,
+                                        CodepointLess());
+  if (found == end || found->codepoint != unicode_codepoint)
+    return NULL;
+  return found;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -108,20 +319,68 @@ int Font::CharacterWidth(uint32_t unicode_codepoint) const {
 
 int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
                     uint32_t unicode_codepoint) const {
-  const Glyph *g = FindGlyph(unicode_codepoint);
-  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
-  if (g == NULL) return 0;
-  y_pos = y_pos - g->height - g->y_offset;
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t row = g->bitmap[y];
-    rowbitmap_t x_mask = 0x80000000;
-    for (int x = 0; x < g->width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      }
+  return DrawGlyph(c, x_pos, y_pos, color, NULL, unicode_codepoint);
+}
+
+int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
+                    const Color *background_color,
+                    uint32_t unicode_codepoint) const {
+  return DrawGlyphs(c, x_pos, y_pos, color, background_color,
+                    &unicode_codepoint, 1);
+}
+
+int Font::DrawGlyphs(Canvas *c, int x_pos, int y_pos, const Color &color,
+                     const Color *background_color,
+                     const uint32_t *codepoints, int count) const {
+  const uint8_t foreground[3] = { color.r, color.g, color.b };
+  uint8_t background[3] = { 0, 0, 0 };
+  if (background_color) {
+    background[0] = background_color->r;
+    background[1] = background_color->g;
+    background[2] = background_color->b;
+  }
+  const Glyph *replacement = NULL;  // Looked up when needed.
+  const int start_x = x_pos;
+  for (int i = 0; i < count; ++i) {
+    const Glyph *g = FindGlyph(codepoints[i]);
+    if (g == NULL) {
+      if (replacement == NULL)
+        replacement = FindGlyph(kUnicodeReplacementCodepoint);
+      g = replacement;
+      if (g == NULL) continue;
+    }
+    DrawGlyph(c, x_pos, y_pos, foreground,
+              background_color ? background : NULL, g);
+    x_pos += g->width;
+  }
+  return x_pos - start_x;
+}
+
+void Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
+                     const uint8_t *foreground, const uint8_t *background,
+                     const Glyph *g) const {
+  const rowbitmap_t *bitmap = bitmaps_ + g->bitmap;
+  const int glyph_top = y_pos - g->height - g->y_offset;
+  if (background == NULL) {
+    c->SetBitmap(x_pos, glyph_top, g->width, g->height, bitmap,
+                 foreground, NULL);
+    return;
+  }
+
+  // The whole character cell, with empty rows above and below the glyph.
+  const int cell_top = std::min(y_pos - base_line_, glyph_top);
+  const int cell_bottom = std::max(y_pos - base_line_ + font_height_,
+                                   glyph_top + g->height);
+  rowbitmap_t rows[32];
+  for (int y = cell_top; y < cell_bottom; y += 32) {
+    const int count = std::min(32, cell_bottom - y);
+    for (int i = 0; i < count; ++i) {
+      const int glyph_row = y + i - glyph_top;
+      rows[i] = (glyph_row >= 0 && glyph_row < g->height)
+        ? bitmap[glyph_row] : 0;
     }
+    c->SetBitmap(x_pos, y, g->width, count, rows, foreground, background);
   }
-  return g->width;
 }
 
 }  // namespace rgb_matrix
@@ -0,0 +1,65 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Conversion of 24bpp pixels into the bitplane layout of the framebuffer.
+// This is the hot loop when pushing full frames, so there are vectorized
+// versions for NEON (Raspberry Pi 2 and later) and SSE2/AVX2 (so that it can
+// be tested and measured on a regular PC); which one is used is decided at
+// compile time.
+#ifndef RPI_BITPLANE_TRANSPOSE_INTERNAL_H
+#define RPI_BITPLANE_TRANSPOSE_INTERNAL_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+// Where the six color bits of a double-row end up in an output word:
+// r1, g1, b1 (upper sub-panel) and r2, g2, b2 (lower sub-panel) are at bit
+// "shift + offset[i]". All offsets need to be less than 16.
+struct ColorBitLayout {
+  int shift;
+  uint8_t offset[6];
+};
+
+// Convert "count" pixels of an "upper" and "lower" sub-panel row (24bpp,
+// one byte each for red, green, blue) to bitplanes.
+// Each color is mapped through "lut" (256 entries), then bit "b" of the
+// result goes to plane "b" for min_plane <= b < max_plane: the word for
+// pixel "i" in plane "b" is out[b * plane_stride + i].
+// Either "upper" or "lower" may be NULL; their bits are left untouched then.
+void MapToBitplanes(const ColorBitLayout &layout, const uint16_t *lut,
+                    const uint8_t *upper, const uint8_t *lower, int count,
+                    int min_plane, int max_plane,
+                    uint32_t *out, int plane_stride);
+
+// Same, for packed bitplanes with one byte per pixel and plane. All bits in
+// "layout" need to fit in the byte.
+void MapToBitplanes(const ColorBitLayout &layout, const uint16_t *lut,
+                    const uint8_t *upper, const uint8_t *lower, int count,
+                    int min_plane, int max_plane,
+                    uint8_t *out, int plane_stride);
+
+// Plain C++ implementation of the above; this is what MapToBitplanes()
+// falls back to if there is no vectorized version for this architecture.
+// The result is always identical.
+void MapToBitplanesScalar(const ColorBitLayout &layout, const uint16_t *lut,
+                          const uint8_t *upper, const uint8_t *lower, int count,
+                          int min_plane, int max_plane,
+                          uint32_t *out, int plane_stride);
+void MapToBitplanesScalar(const ColorBitLayout &layout, const uint16_t *lut,
+                          const uint8_t *upper, const uint8_t *lower, int count,
+                          int min_plane, int max_plane,
+                          uint8_t *out, int plane_stride);
+}  // namespace rgb_matrix
+#endif  // RPI_BITPLANE_TRANSPOSE_INTERNAL_H
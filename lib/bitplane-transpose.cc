@@ -0,0 +1,304 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "bitplane-transpose-internal.h"
+
+#include <stddef.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define BITPLANE_VECTOR_NEON 1
+#elif defined(__AVX2__)
+#  include <immintrin.h>
+#  define BITPLANE_VECTOR_AVX2 1
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define BITPLANE_VECTOR_SSE2 1
+#endif
+
+#if defined(BITPLANE_VECTOR_NEON) || defined(BITPLANE_VECTOR_SSE2) \
+  || defined(BITPLANE_VECTOR_AVX2)
+#  define BITPLANE_VECTOR 1
+#endif
+
+namespace rgb_matrix {
+// The output bits we write for the sub-panels that are given.
+static uint32_t ColorMask(const ColorBitLayout &layout,
+                          bool upper, bool lower) {
+  uint32_t mask = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (upper) mask |= 1u << (layout.shift + layout.offset[i]);
+    if (lower) mask |= 1u << (layout.shift + layout.offset[i + 3]);
+  }
+  return mask;
+}
+
+template <typename Word>
+static void MapScalar(const ColorBitLayout &layout, const uint16_t *lut,
+                      const uint8_t *upper, const uint8_t *lower, int count,
+                      int min_plane, int max_plane,
+                      Word *out, int plane_stride) {
+  const Word keep = ~ColorMask(layout, upper != NULL, lower != NULL);
+  Word color_bit[6];
+  for (int k = 0; k < 6; ++k) {
+    color_bit[k] = 1u << (layout.shift + layout.offset[k]);
+  }
+  for (int i = 0; i < count; ++i) {
+    uint16_t c[6] = { 0, 0, 0, 0, 0, 0 };
+    if (upper) {
+      c[0] = lut[upper[0]]; c[1] = lut[upper[1]]; c[2] = lut[upper[2]];
+      upper += 3;
+    }
+    if (lower) {
+      c[3] = lut[lower[0]]; c[4] = lut[lower[1]]; c[5] = lut[lower[2]];
+      lower += 3;
+    }
+    for (int b = min_plane; b < max_plane; ++b) {
+      const uint16_t mask = 1 << b;
+      Word color = 0;
+      for (int k = 0; k < 6; ++k) {
+        if (c[k] & mask) color |= color_bit[k];
+      }
+      Word *word = out + b * plane_stride + i;
+      *word = (*word & keep) | color;
+    }
+  }
+}
+
+void MapToBitplanesScalar(const ColorBitLayout &layout, const uint16_t *lut,
+                          const uint8_t *upper, const uint8_t *lower, int count,
+                          int min_plane, int max_plane,
+                          uint32_t *out, int plane_stride) {
+  MapScalar(layout, lut, upper, lower, count, min_plane, max_plane,
+            out, plane_stride);
+}
+
+void MapToBitplanesScalar(const ColorBitLayout &layout, const uint16_t *lut,
+                          const uint8_t *upper, const uint8_t *lower, int count,
+                          int min_plane, int max_plane,
+                          uint8_t *out, int plane_stride) {
+  MapScalar(layout, lut, upper, lower, count, min_plane, max_plane,
+            out, plane_stride);
+}
+
+#ifdef BITPLANE_VECTOR
+// The vector implementations: one pixel per 16 bit lane. Each provides
+//   Block       : vector type with kBlockPixels 16 bit lanes.
+//   LoadBlock() : load kBlockPixels uint16_t (aligned).
+//   Splat()     : a Block with the value in all lanes.
+//   CollectBit(): in lanes where "channel" has the "plane" bit set, add
+//                 "color_bit".
+//   StorePlane(): shift Block lanes by "shift" into the output words,
+//                 merging with the bits to "keep".
+#if defined(BITPLANE_VECTOR_NEON)
+enum { kBlockPixels = 8 };
+typedef uint16x8_t Block;
+static inline Block LoadBlock(const uint16_t *v) { return vld1q_u16(v); }
+static inline Block Splat(uint16_t v) { return vdupq_n_u16(v); }
+static inline Block CollectBit(Block p, Block channel, Block plane,
+                               Block color_bit) {
+  return vorrq_u16(p, vandq_u16(vtstq_u16(channel, plane), color_bit));
+}
+static inline void StorePlane(uint32_t *word, Block p, int shift,
+                              uint32_t keep_bits) {
+  const uint32x4_t keep = vdupq_n_u32(keep_bits);
+  const int32x4_t s = vdupq_n_s32(shift);
+  const uint32x4_t lo = vshlq_u32(vmovl_u16(vget_low_u16(p)), s);
+  const uint32x4_t hi = vshlq_u32(vmovl_u16(vget_high_u16(p)), s);
+  vst1q_u32(word, vorrq_u32(vandq_u32(vld1q_u32(word), keep), lo));
+  vst1q_u32(word + 4, vorrq_u32(vandq_u32(vld1q_u32(word + 4), keep), hi));
+}
+static inline void StorePlane(uint8_t *word, Block p, int shift,
+                              uint32_t keep_bits) {
+  const uint8x8_t keep = vdup_n_u8(keep_bits);
+  const uint8x8_t bytes = vmovn_u16(vshlq_u16(p, vdupq_n_s16(shift)));
+  vst1_u8(word, vorr_u8(vand_u8(vld1_u8(word), keep), bytes));
+}
+
+#elif defined(BITPLANE_VECTOR_SSE2)
+enum { kBlockPixels = 8 };
+typedef __m128i Block;
+static inline Block LoadBlock(const uint16_t *v) {
+  return _mm_load_si128((const __m128i*) v);
+}
+static inline Block Splat(uint16_t v) { return _mm_set1_epi16(v); }
+static inline Block CollectBit(Block p, Block channel, Block plane,
+                               Block color_bit) {
+  // All ones in the lanes that don't have the plane bit set.
+  const __m128i unset = _mm_cmpeq_epi16(_mm_and_si128(channel, plane),
+                                        _mm_setzero_si128());
+  return _mm_or_si128(p, _mm_andnot_si128(unset, color_bit));
+}
+static inline void StorePlane(uint32_t *out, Block p, int shift,
+                              uint32_t keep_bits) {
+  const __m128i keep = _mm_set1_epi32(keep_bits);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i *word = (__m128i*) out;
+  const __m128i lo = _mm_sll_epi32(_mm_unpacklo_epi16(p, zero), s);
+  const __m128i hi = _mm_sll_epi32(_mm_unpackhi_epi16(p, zero), s);
+  _mm_storeu_si128(word, _mm_or_si128(
+                     _mm_and_si128(_mm_loadu_si128(word), keep), lo));
+  _mm_storeu_si128(word + 1, _mm_or_si128(
+                     _mm_and_si128(_mm_loadu_si128(word + 1), keep), hi));
+}
+static inline void StorePlane(uint8_t *out, Block p, int shift,
+                              uint32_t keep_bits) {
+  const __m128i keep = _mm_set1_epi8(keep_bits);
+  __m128i *word = (__m128i*) out;
+  const __m128i bytes = _mm_packus_epi16(
+    _mm_sll_epi16(p, _mm_cvtsi32_si128(shift)), _mm_setzero_si128());
+  _mm_storel_epi64(word, _mm_or_si128(
+                     _mm_and_si128(_mm_loadl_epi64(word), keep), bytes));
+}
+
+#elif defined(BITPLANE_VECTOR_AVX2)
+enum { kBlockPixels = 16 };
+typedef __m256i Block;
+static inline Block LoadBlock(const uint16_t *v) {
+  return _mm256_load_si256((const __m256i*) v);
+}
+static inline Block Splat(uint16_t v) { return _mm256_set1_epi16(v); }
+static inline Block CollectBit(Block p, Block channel, Block plane,
+                               Block color_bit) {
+  const __m256i unset = _mm256_cmpeq_epi16(_mm256_and_si256(channel, plane),
+                                           _mm256_setzero_si256());
+  return _mm256_or_si256(p, _mm256_andnot_si256(unset, color_bit));
+}
+static inline void StorePlane(uint32_t *out, Block p, int shift,
+                              uint32_t keep_bits) {
+  const __m256i keep = _mm256_set1_epi32(keep_bits);
+  const __m128i s = _mm_cvtsi32_si128(shift);
+  __m256i *word = (__m256i*) out;
+  const __m256i lo = _mm256_sll_epi32(
+    _mm256_cvtepu16_epi32(_mm256_castsi256_si128(p)), s);
+  const __m256i hi = _mm256_sll_epi32(
+    _mm256_cvtepu16_epi32(_mm256_extracti128_si256(p, 1)), s);
+  _mm256_storeu_si256(word, _mm256_or_si256(
+                        _mm256_and_si256(_mm256_loadu_si256(word), keep), lo));
+  _mm256_storeu_si256(word + 1, _mm256_or_si256(
+                        _mm256_and_si256(_mm256_loadu_si256(word + 1), keep),
+                        hi));
+}
+static inline void StorePlane(uint8_t *out, Block p, int shift,
+                              uint32_t keep_bits) {
+  const __m128i keep = _mm_set1_epi8(keep_bits);
+  const __m256i shifted = _mm256_sll_epi16(p, _mm_cvtsi32_si128(shift));
+  __m128i *word = (__m128i*) out;
+  const __m128i bytes = _mm_packus_epi16(
+    _mm256_castsi256_si128(shifted), _mm256_extracti128_si256(shifted, 1));
+  _mm_storeu_si128(word, _mm_or_si128(
+                     _mm_and_si128(_mm_loadu_si128(word), keep), bytes));
+}
+#endif
+
+// Look up the colors of one block of pixels into the six channel arrays.
+// Channels of a missing sub-panel are not touched.
+static inline void LookupBlock(const uint16_t *lut,
+                               const uint8_t *upper, const uint8_t *lower,
+                               uint16_t channels[6][kBlockPixels]) {
+  if (upper) {
+    for (int i = 0; i < kBlockPixels; ++i, upper += 3) {
+      channels[0][i] = lut[upper[0]];
+      channels[1][i] = lut[upper[1]];
+      channels[2][i] = lut[upper[2]];
+    }
+  }
+  if (lower) {
+    for (int i = 0; i < kBlockPixels; ++i, lower += 3) {
+      channels[3][i] = lut[lower[0]];
+      channels[4][i] = lut[lower[1]];
+      channels[5][i] = lut[lower[2]];
+    }
+  }
+}
+
+// Convert "blocks" times kBlockPixels pixels.
+// Per block, all channels are in vector registers. For each plane, we test
+// the plane bit in each channel and collect the result at the channel's
+// offset, which gives the six color bits of kBlockPixels pixels in one
+// register. These are then shifted into the output words and merged with
+// the bits already there.
+template <typename Word>
+static void MapBlocks(const ColorBitLayout &layout, const uint16_t *lut,
+                      const uint8_t *upper, const uint8_t *lower, int blocks,
+                      int min_plane, int max_plane,
+                      Word *out, int plane_stride) {
+  const uint32_t keep = ~ColorMask(layout, upper != NULL, lower != NULL);
+  // Only look at the channels of the sub-panels we have.
+  const int first_channel = upper ? 0 : 3;
+  const int end_channel = lower ? 6 : 3;
+  uint16_t channels[6][kBlockPixels] __attribute__((aligned(32)));
+  Block color_bit[6];
+  for (int k = 0; k < 6; ++k) color_bit[k] = Splat(1 << layout.offset[k]);
+  Block ch[6];
+
+  for (int block = 0; block < blocks; ++block) {
+    LookupBlock(lut, upper, lower, channels);
+    for (int k = first_channel; k < end_channel; ++k)
+      ch[k] = LoadBlock(channels[k]);
+    for (int b = min_plane; b < max_plane; ++b) {
+      const Block plane = Splat(1 << b);
+      Block p = Splat(0);
+      for (int k = first_channel; k < end_channel; ++k) {
+        p = CollectBit(p, ch[k], plane, color_bit[k]);
+      }
+      StorePlane(out + b * plane_stride, p, layout.shift, keep);
+    }
+    if (upper) upper += 3 * kBlockPixels;
+    if (lower) lower += 3 * kBlockPixels;
+    out += kBlockPixels;
+  }
+}
+#endif  // BITPLANE_VECTOR
+
+template <typename Word>
+static void Map(const ColorBitLayout &layout, const uint16_t *lut,
+                const uint8_t *upper, const uint8_t *lower, int count,
+                int min_plane, int max_plane,
+                Word *out, int plane_stride) {
+#ifdef BITPLANE_VECTOR
+  const int blocks = count / kBlockPixels;
+  MapBlocks(layout, lut, upper, lower, blocks, min_plane, max_plane,
+            out, plane_stride);
+  const int done = blocks * kBlockPixels;
+  if (done == count) return;
+  // The remaining pixels.
+  if (upper) upper += 3 * done;
+  if (lower) lower += 3 * done;
+  MapScalar(layout, lut, upper, lower, count - done,
+            min_plane, max_plane, out + done, plane_stride);
+#else
+  MapScalar(layout, lut, upper, lower, count,
+            min_plane, max_plane, out, plane_stride);
+#endif
+}
+
+void MapToBitplanes(const ColorBitLayout &layout, const uint16_t *lut,
+                    const uint8_t *upper, const uint8_t *lower, int count,
+                    int min_plane, int max_plane,
+                    uint32_t *out, int plane_stride) {
+  Map(layout, lut, upper, lower, count, min_plane, max_plane,
+      out, plane_stride);
+}
+
+void MapToBitplanes(const ColorBitLayout &layout, const uint16_t *lut,
+                    const uint8_t *upper, const uint8_t *lower, int count,
+                    int min_plane, int max_plane,
+                    uint8_t *out, int plane_stride) {
+  Map(layout, lut, upper, lower, count, min_plane, max_plane,
+      out, plane_stride);
+}
+}  // namespace rgb_matrix
@@ -15,20 +15,95 @@
 #ifndef RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 #define RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "led-matrix.h"
+#include "pixel-mapper.h"
+#include "bitplane-transpose-internal.h"
 
 namespace rgb_matrix {
+enum {
+  kBitPlanes = 11,  // maximum usable bitplanes.
+  kMaxParallelChains = 3
+};
+
+// Default on-time of the least significant bitplane.
+static const long kDefaultBitplaneBaseNanos = 200;
+
+// Sum of the differences between actual and intended on-time of the
+// bitplanes while writing out, how often each bitplane was shown, the
+// total time the LEDs were lit and the time bitplanes were kept dark. Also
+// the most bitplanes that had to be clocked in for one double-row.
+struct BitplaneTiming {
+  BitplaneTiming() : lit_nanos(0), dark_nanos(0), max_row_planes(0) {
+    for (int b = 0; b < kBitPlanes; ++b) error_nanos[b] = count[b] = 0;
+  }
+  int64_t error_nanos[kBitPlanes];
+  int64_t count[kBitPlanes];
+  int64_t lit_nanos;
+  int64_t dark_nanos;
+  int max_row_planes;
+};
+
+// The bits of a GPIO word, as they are connected to the matrix.
+union IoBits {
+  struct {
+    // These reflect the GPIO mapping. The Revision1 and Revision2 boards
+    // have different GPIO mappings for 0/1 vs 3/4. Just use both.
+    unsigned int output_enable_rev1 : 1;  // 0
+    unsigned int clock_rev1 : 1;          // 1
+    unsigned int output_enable_rev2 : 1;  // 2
+    unsigned int clock_rev2  : 1;         // 3
+    unsigned int strobe : 1;              // 4
+    unsigned int p1_g1 : 1;               // 5   Colors of the 2nd and 3rd
+    unsigned int p1_b1 : 1;               // 6   parallel chain: p1_, p2_
+    unsigned int row : 5;                 // 7..11  A, B, C, D, E
+    unsigned int p1_r1 : 1;               // 12
+    unsigned int p1_g2 : 1;               // 13
+    unsigned int p2_r1 : 1;               // 14
+    unsigned int p2_g1 : 1;               // 15
+    unsigned int p2_b1 : 1;               // 16
+    unsigned int r1 : 1;                  // 17
+    unsigned int g1 : 1;                  // 18
+    unsigned int p1_r2 : 1;               // 19
+    unsigned int p1_b2 : 1;               // 20
+    unsigned int p2_r2 : 1;               // 21
+    unsigned int b1 : 1;                  // 22
+    unsigned int r2 : 1;                  // 23
+    unsigned int g2 : 1;                  // 24
+    unsigned int b2 : 1;                  // 25
+    unsigned int p2_g2 : 1;               // 26
+    unsigned int p2_b2 : 1;               // 27
+  } bits;
+  uint32_t raw;
+  IoBits() : raw(0) {}
+};
+
+// The bits of r1, g1, b1, r2, g2, b2 of the parallel "chain"
+// (0 <= chain < kMaxParallelChains) in IoBits.
+void GetChainColorBits(int chain, uint32_t bits[6]);
+
 // Internal representation of the frame-buffer that as well can
 // write itself to GPIO.
 // Our internal memory layout mimicks as much as possible what needs to be
 // written out.
 class RGBMatrix::Framebuffer {
 public:
-  Framebuffer(int rows, int columns);
+  // The frame is "parallel" chains of "rows" x "columns" stacked on top of
+  // each other. If "mapper" is not NULL, the frame is arranged as it
+  // describes; it is only used in the constructor.
+  Framebuffer(int rows, int columns, int parallel = 1,
+              Multiplexing multiplexing = kDirectMultiplexing,
+              const PixelMapper *mapper = NULL,
+              BitplaneLayout bitplane_layout = kFullWordBitplanes,
+              long bitplane_base_nanos = kDefaultBitplaneBaseNanos,
+              bool optimize_static_content = false,
+              bool temporal_dithering = false);
   ~Framebuffer();
 
   // Initialize GPIO bits for output.
-  static void InitGPIO(GPIO *io);
+  void InitGPIO(OutputBackend *io) const;
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
@@ -37,64 +112,252 @@ public:
   uint8_t pwmbits() { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
-  void DumpToMatrix(GPIO *io);
+  // Brightness in percent (0..100) by which the on-time of the bitplanes is
+  // scaled. Can be changed while the frame is written out.
+  // Returns boolean to signify if value was within range.
+  bool SetBrightness(uint8_t percent);
+  uint8_t brightness() const {
+    return __atomic_load_n(&brightness_, __ATOMIC_RELAXED);
+  }
+
+  // Scan-out transformation, applied while clocking in: the column at x
+  // shows column (x + offset) % columns of the frame, then the chain is
+  // mirrored horizontally and/or vertically. Each is read once per
+  // DumpToMatrix(), so it can be changed while the frame is written out.
+  enum {
+    kMirrorHorizontal = 1,
+    kMirrorVertical   = 2
+  };
+  void SetScanOffset(int offset);
+  int scan_offset() const {
+    return __atomic_load_n(&scan_offset_, __ATOMIC_RELAXED);
+  }
+  void SetScanMirror(uint8_t mirror) {
+    __atomic_store_n(&scan_mirror_, mirror, __ATOMIC_RELAXED);
+  }
+  uint8_t scan_mirror() const {
+    return __atomic_load_n(&scan_mirror_, __ATOMIC_RELAXED);
+  }
+
+  // Write the frame to "io". If "timing" is not NULL, the measured on-time
+  // of the bitplanes is added to it.
+  void DumpToMatrix(OutputBackend *io, BitplaneTiming *timing = NULL);
+
+  // Whether anything changed since the last DumpToMatrix().
+  bool HasChanges() const {
+    return __atomic_load_n(&changed_, __ATOMIC_ACQUIRE);
+  }
 
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
-  inline int width() const { return columns_; }
-  inline int height() const { return rows_; }
+  inline int width() const { return width_; }
+  inline int height() const { return height_; }
+  // Intended on-time of bitplane "b" with the current brightness.
+  long bitplane_nanos(int b) const {
+    return bitplane_nanos_[b] * brightness() / 100;
+  }
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb_data, int stride);
+  void SetBitmap(int x, int y, int width, int height, const uint32_t *rows,
+                 const uint8_t *foreground, const uint8_t *background);
+
+  // Copy the bitplanes of "width" columns from column "from_x" of "other"
+  // to column "x", all rows. Both need kDirectMultiplexing without a
+  // PixelMapper and the same rows, chains and layout. Returns false if
+  // "other" has fewer bitplanes filled or another luminance correction.
+  bool CopyColumns(const Framebuffer &other, int from_x, int x, int width);
 
 private:
-  // Map color
-  inline uint16_t MapColor(uint8_t c);
+  template <class Output>
+  void DumpToOutput(Output *out, BitplaneTiming *timing);
+
+  // Lowest bitplane that is filled when setting pixels: the ones shown, or
+  // all of them with temporal dithering.
+  int FirstFilledPlane() const {
+    return temporal_dithering_ ? 0 : kBitPlanes - pwm_bits_;
+  }
+
+  // SetPixel() with the color already in ColorPlanes(), without clipping
+  // or shadow.
+  inline void SetPixelPlanes(int x, int y, uint64_t planes);
+
+  // One row of SetBitmap(), already clipped: the "width" pixels at (x, y)
+  // from the highest bits of "row".
+  void SetBitmapRow(int x, int y, uint32_t row, int width,
+                    const uint8_t *foreground, const uint8_t *background);
+
+  // Bitplane conversion of SetPixels(), without clipping or change check.
+  void ConvertPixels(int x, int y, int width, int height,
+                     const uint8_t *rgb_data, int stride);
+
+  // Position of pixel (x, y) of a chain in the shift registers: column
+  // "*column" of row "*row", with 0 <= *row < rows_.
+  inline void MapPosition(int x, int y, int *column, int *row) const;
+
+  // Fill row_partner_ from positions_.
+  void FindRowPartners();
+
+  // Convert a row of "width" pixels at (x, y) through positions_, together
+  // with the same pixels of its row_partner_ if "partner_pixels" is not NULL.
+  void ConvertMappedRow(int x, int y, int width, const uint8_t *pixels,
+                        const uint8_t *partner_pixels);
 
-  const int rows_;     // Number of rows. 16 or 32.
-  const int columns_;  // Number of columns. Number of chained boards * 32.
+  // Bits of the row address lines in use.
+  uint32_t RowAddressMask() const;
+
+  // Convert "width" pixels of a "chain" to bitplanes of "double_row", starting
+  // at column "x". "upper" or "lower" can be NULL.
+  void MapRows(int chain, int double_row, int x,
+               const uint8_t *upper, const uint8_t *lower, int width);
+
+  // Remember that "double_row" has been modified. Call after modifying.
+  inline void MarkChanged(int double_row) {
+    __atomic_store_n(&row_dirty_[double_row], 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&changed_, true, __ATOMIC_RELEASE);
+  }
+
+  // Find out which bitplanes of the modified rows are dark or the same as
+  // the one clocked in before (see plane_repeats_).
+  void UpdatePlaneRepeats();
+  bool IsDarkPlane(int double_row, int bit);
+
+  // Fill color_lut_ and color_spread_ for the current luminance correction.
+  void UpdateColorTables();
+
+  // The bits of a color in each bitplane: bits 3b, 3b+1, 3b+2 are red,
+  // green and blue in bitplane b.
+  inline uint64_t ColorPlanes(uint8_t r, uint8_t g, uint8_t b) const {
+    return color_spread_[r] | color_spread_[g] << 1 | color_spread_[b] << 2;
+  }
+
+  // Size of a chain as it is scanned out; with multiplexing other than
+  // kDirectMultiplexing, that is different from what it looks like.
+  const int rows_;        // Rows, twice the number of row addresses.
+  const int columns_;     // Columns: length of the shift registers.
+  const int parallel_;    // Number of chains clocked in parallel.
+  const Multiplexing multiplexing_;
+  const int chain_rows_;  // Visible rows of a chain. 16, 32 or 64.
+  const int width_;       // Visible size: chained boards * 32 x chain_rows_
+  const int height_;      // * parallel_, unless arranged by a PixelMapper.
+  const BitplaneLayout bitplane_layout_;
+  const long bitplane_base_nanos_;
+  long bitplane_nanos_[kBitPlanes];  // On-time of each bitplane at 100%.
+
+  // With temporal dithering, the bitplanes below the PWM bits take turns in
+  // an extra slot of each refresh (see DumpToOutput()); dither_pass_ counts
+  // the refreshes.
+  const bool temporal_dithering_;
+  unsigned int dither_pass_;
 
   uint8_t pwm_bits_;   // PWM bits to display.
+  uint8_t brightness_;
+  int scan_offset_;      // 0 <= scan_offset_ < columns_
+  uint8_t scan_mirror_;  // kMirrorHorizontal | kMirrorVertical
   bool do_luminance_correct_;
+  // 8 bit color -> kBitPlanes bits output, and the same with the bit of
+  // each bitplane "b" at bit 3 * b (see ColorPlanes()).
+  uint16_t color_lut_[256];
+  uint64_t color_spread_[256];
 
   const int double_rows_;
   const uint8_t row_mask_;
 
-  union IoBits {
-    struct {
-      // These reflect the GPIO mapping. The Revision1 and Revision2 boards
-      // have different GPIO mappings for 0/1 vs 3/4. Just use both.
-      unsigned int output_enable_rev1 : 1;  // 0
-      unsigned int clock_rev1 : 1;          // 1
-      unsigned int output_enable_rev2 : 1;  // 2
-      unsigned int clock_rev2  : 1;         // 3
-      unsigned int strobe : 1;              // 4
-      unsigned int unused2 : 2;             // 5..6
-      unsigned int row : 4;                 // 7..10
-      unsigned int unused3 : 6;             // 11..16
-      unsigned int r1 : 1;                  // 17
-      unsigned int g1 : 1;                  // 18
-      unsigned int unused4 : 3;
-      unsigned int b1 : 1;                  // 22
-      unsigned int r2 : 1;                  // 23
-      unsigned int g2 : 1;                  // 24
-      unsigned int b2 : 1;                  // 25
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
-  };
-
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
   // For each double-row, we store pwm-bits columns of a bitplane.
   // Each bitplane-column is pre-filled IoBits, of which the colors are set.
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
+  // With kPackedBitplanes, we only store a byte with the color bits for each
+  // bitplane-column in packed_buffer_ (same order), and expand it to IoBits
+  // with packed_expand_[] while writing out. Only one of these buffers is
+  // allocated.
+  // With parallel chains, the words in bitplane_buffer_ have the bits of all
+  // chains, while packed_buffer_ has the bytes of each chain one after the
+  // other in each bitplane.
   IoBits *bitplane_buffer_;
-  inline IoBits *ValueAt(int double_row, int column, int bit);
+  inline IoBits *ValueAt(int double_row, int column, int bit) const;
+  uint8_t *packed_buffer_;
+  inline uint8_t *PackedAt(int chain, int double_row, int column,
+                           int bit) const;
+  // Start of the data of a bitplane of a double-row, whatever the layout.
+  inline const uint8_t *PlaneData(int double_row, int bit);
+  uint32_t packed_expand_[kMaxParallelChains][64];
+  // The same with the upper and lower half swapped, for kMirrorVertical.
+  uint32_t packed_swapped_expand_[kMaxParallelChains][64];
+
+  // Swapping the upper and lower half in IoBits, for kMirrorVertical: a
+  // delta swap of the bits in "mask" with the ones "shift" bits higher,
+  // for each distance between the color bits of the two halves.
+  struct HalfSwap {
+    uint32_t mask;
+    int shift;
+  };
+  HalfSwap half_swaps_[3 * kMaxParallelChains];
+  int half_swap_count_;
+  inline uint32_t SwapHalves(uint32_t bits) const {
+    for (int i = 0; i < half_swap_count_; ++i) {
+      const HalfSwap &swap = half_swaps_[i];
+      const uint32_t t = ((bits >> swap.shift) ^ bits) & swap.mask;
+      bits ^= t ^ (t << swap.shift);
+    }
+    return bits;
+  }
+
+  // Color bits of each chain in IoBits: r1, g1, b1, r2, g2, b2.
+  uint32_t color_bits_[kMaxParallelChains][6];
+
+  // Per chain and upper/lower half, the IoBits for each combination of
+  // red (1), green (2) and blue (4).
+  uint32_t color_words_[kMaxParallelChains][2][8];
+
+  // Where the color bits are in IoBits and in the packed bytes, for the
+  // bulk conversion.
+  ColorBitLayout color_layout_[kMaxParallelChains];
+  ColorBitLayout packed_layout_;
+
+  // Where each visible pixel is in the bitplanes, row by row. Only with a
+  // PixelMapper or multiplexing other than kDirectMultiplexing, NULL
+  // otherwise: then, the position follows from the coordinates.
+  struct PixelPosition {
+    enum { kNotShown = 0xff };
+    uint16_t column;
+    uint8_t double_row;
+    uint8_t sub_panel;   // 2 * chain + (lower half ? 1 : 0), or kNotShown
+  };
+  PixelPosition *positions_;
+
+  // With positions_: per visible row, the row that is in the other half of
+  // the same double-rows, column by column, or -1. Such rows are converted
+  // together, so that each bitplane word is written only once.
+  int *row_partner_;
+
+  // -- Change tracking.
+  bool changed_;        // Modified since last DumpToMatrix()
+  uint8_t *row_dirty_;  // Per double-row: modified since UpdatePlaneRepeats()
+
+  // With optimize_static_content, a copy of the RGB pixels as they were
+  // last set (height x width x 3), so that writing the same pixels again
+  // does not need to be converted. NULL otherwise.
+  uint8_t *shadow_;
+
+  // Per double-row and bitplane, if no LED is on in it, so that it does
+  // not need to be clocked in at all, or if its columns are the same as
+  // those of the bitplane clocked in before it, so that they are still in
+  // the shift registers of the panels. Saturated colors, e.g. text, have
+  // most bitplanes the same.
+  enum {
+    kSameAsPreviousPlane = 1,    // Same as bitplane b-1 of the same row.
+    kSameAsPreviousRow   = 2,    // Same as the last bitplane of the row before.
+    kDarkPlane           = 4     // All color bits are off.
+  };
+  uint8_t *plane_repeats_;
 };
 }  // namespace rgb_matrix
 #endif // RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
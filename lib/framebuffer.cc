@@ -22,89 +22,307 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
-#include <time.h>
 #include <math.h>
 
-namespace rgb_matrix {
-enum {
-  kBitPlanes = 11  // maximum usable bitplanes.
-};
+#include <algorithm>
 
-static const long kBaseTimeNanos = 200;
-const long row_sleep_nanos[11] = {
-  (1 * kBaseTimeNanos),
-  (2 * kBaseTimeNanos),
-  (4 * kBaseTimeNanos),
-  (8 * kBaseTimeNanos),
-  (16 * kBaseTimeNanos),
-  (32 * kBaseTimeNanos),
-  (64 * kBaseTimeNanos),
-  (128 * kBaseTimeNanos),
-  (256 * kBaseTimeNanos),
-  (512 * kBaseTimeNanos),
-  (1024 * kBaseTimeNanos),
-};
+namespace rgb_matrix {
+void GetChainColorBits(int chain, uint32_t bits[6]) {
+  IoBits b[6];
+  switch (chain) {
+  case 0:
+    b[0].bits.r1 = 1; b[1].bits.g1 = 1; b[2].bits.b1 = 1;
+    b[3].bits.r2 = 1; b[4].bits.g2 = 1; b[5].bits.b2 = 1;
+    break;
+  case 1:
+    b[0].bits.p1_r1 = 1; b[1].bits.p1_g1 = 1; b[2].bits.p1_b1 = 1;
+    b[3].bits.p1_r2 = 1; b[4].bits.p1_g2 = 1; b[5].bits.p1_b2 = 1;
+    break;
+  case 2:
+    b[0].bits.p2_r1 = 1; b[1].bits.p2_g1 = 1; b[2].bits.p2_b1 = 1;
+    b[3].bits.p2_r2 = 1; b[4].bits.p2_g2 = 1; b[5].bits.p2_b2 = 1;
+    break;
+  default:
+    assert(false);
+  }
+  for (int i = 0; i < 6; ++i) bits[i] = b[i].raw;
+}
 
-static void sleep_nanos(long nanos) {
-  // For sleep times above 20usec, nanosleep seems to be fine, but it has
-  // an offset of about 20usec (on the RPi distribution I was testing it on).
-  // That means, we need to give it 80us to get 100us.
-  // For values lower than roughly 30us, this is not accurate anymore and we
-  // need to switch to busy wait.
-  // TODO: compile Linux kernel realtime extensions and watch if the offset-time
-  // changes and hope for less jitter.
-  if (nanos > 28000) {
-    struct timespec sleep_time = { 0, nanos - 20000 };
-    nanosleep(&sleep_time, NULL);
+RGBMatrix::Framebuffer::Framebuffer(int rows, int columns, int parallel,
+                                    Multiplexing multiplexing,
+                                    const PixelMapper *mapper,
+                                    BitplaneLayout bitplane_layout,
+                                    long bitplane_base_nanos,
+                                    bool optimize_static_content,
+                                    bool temporal_dithering)
+  : rows_(multiplexing == kDirectMultiplexing ? rows : rows / 2),
+    columns_(multiplexing == kDirectMultiplexing ? columns : 2 * columns),
+    parallel_(parallel), multiplexing_(multiplexing),
+    chain_rows_(rows),
+    width_(mapper ? mapper->width() : columns),
+    height_(mapper ? mapper->height() : rows * parallel),
+    bitplane_layout_(bitplane_layout),
+    bitplane_base_nanos_(bitplane_base_nanos),
+    temporal_dithering_(temporal_dithering), dither_pass_(0),
+    pwm_bits_(kBitPlanes), brightness_(100), scan_offset_(0), scan_mirror_(0),
+    do_luminance_correct_(true),
+    double_rows_(rows_ / 2), row_mask_(double_rows_ - 1),
+    bitplane_buffer_(NULL), packed_buffer_(NULL),
+    positions_(NULL), row_partner_(NULL),
+    changed_(true), row_dirty_(new uint8_t[double_rows_]), shadow_(NULL),
+    plane_repeats_(NULL) {
+  assert(sizeof(IoBits) == sizeof(uint32_t));  // We access them as words.
+  assert(parallel_ >= 1 && parallel_ <= kMaxParallelChains);
+  assert(chain_rows_ == 16 || chain_rows_ == 32 || chain_rows_ == 64);
+  // Binary code modulation: each bitplane is shown twice as long as the
+  // previous one.
+  for (int b = 0; b < kBitPlanes; ++b) {
+    bitplane_nanos_[b] = bitplane_base_nanos_ << b;
+  }
+  if (bitplane_layout_ == kPackedBitplanes) {
+    packed_buffer_
+      = new uint8_t [double_rows_ * columns_ * parallel_ * kBitPlanes];
   } else {
-    // The following loop is determined empirically on a 700Mhz RPi
-    for (int i = nanos >> 2; i != 0; --i) {
-      asm("");   // force GCC not to optimize this away.
+    bitplane_buffer_ = new IoBits [double_rows_ * columns_ * kBitPlanes];
+  }
+  UpdateColorTables();
+
+  // Find out where the color bits of each chain are.
+  for (int chain = 0; chain < kMaxParallelChains; ++chain) {
+    const uint32_t *const bits = color_bits_[chain];
+    GetChainColorBits(chain, color_bits_[chain]);
+    ColorBitLayout &layout = color_layout_[chain];
+    layout.shift = __builtin_ctz(bits[0]);
+    for (int i = 0; i < 6; ++i) {
+      layout.shift = std::min(layout.shift, __builtin_ctz(bits[i]));
+    }
+    for (int i = 0; i < 6; ++i) {
+      layout.offset[i] = __builtin_ctz(bits[i]) - layout.shift;
+      assert(layout.offset[i] < 16);
+    }
+
+    for (int packed = 0; packed < 64; ++packed) {
+      packed_expand_[chain][packed] = 0;
+      for (int i = 0; i < 6; ++i) {
+        if (packed & (1 << i)) packed_expand_[chain][packed] |= bits[i];
+      }
+    }
+    for (int color = 0; color < 8; ++color) {
+      color_words_[chain][0][color] = packed_expand_[chain][color];
+      color_words_[chain][1][color] = packed_expand_[chain][color << 3];
+    }
+    for (int packed = 0; packed < 64; ++packed) {
+      packed_swapped_expand_[chain][packed]
+        = packed_expand_[chain][(packed >> 3) | (packed & 0x07) << 3];
+    }
+  }
+
+  // Group the pairs of upper and lower color bits of the chains in use by
+  // their distance.
+  half_swap_count_ = 0;
+  for (int chain = 0; chain < parallel_; ++chain) {
+    for (int i = 0; i < 3; ++i) {
+      uint32_t low = color_bits_[chain][i], high = color_bits_[chain][i + 3];
+      if (low > high) std::swap(low, high);
+      const int shift = __builtin_ctz(high) - __builtin_ctz(low);
+      int s = 0;
+      while (s < half_swap_count_ && half_swaps_[s].shift != shift) ++s;
+      if (s == half_swap_count_) {
+        half_swaps_[s].mask = 0;
+        half_swaps_[s].shift = shift;
+        ++half_swap_count_;
+      }
+      half_swaps_[s].mask |= low;
     }
   }
-}
 
-RGBMatrix::Framebuffer::Framebuffer(int rows, int columns)
-  : rows_(rows), columns_(columns),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true),
-    double_rows_(rows / 2), row_mask_(double_rows_ - 1) {
-  bitplane_buffer_ = new IoBits [double_rows_ * columns_ * kBitPlanes];
+  // Packed: r1, g1, b1, r2, g2, b2 from the lowest bit up.
+  packed_layout_.shift = 0;
+  for (int i = 0; i < 6; ++i) packed_layout_.offset[i] = i;
+
+  if (mapper || multiplexing_ != kDirectMultiplexing) {
+    positions_ = new PixelPosition [width_ * height_];
+    for (int y = 0; y < height_; ++y) {
+      for (int x = 0; x < width_; ++x) {
+        PixelPosition &pos = positions_[y * width_ + x];
+        int matrix_x = x, matrix_y = y;
+        if (mapper && !mapper->Map(x, y, &matrix_x, &matrix_y)) {
+          pos.sub_panel = PixelPosition::kNotShown;
+          continue;
+        }
+        int column, row;
+        MapPosition(matrix_x, matrix_y % chain_rows_, &column, &row);
+        pos.column = column;
+        pos.double_row = row & row_mask_;
+        pos.sub_panel = (2 * (matrix_y / chain_rows_)
+                         + (row < double_rows_ ? 0 : 1));
+      }
+    }
+    FindRowPartners();
+  }
+
+  memset(row_dirty_, 1, double_rows_);
+  plane_repeats_ = new uint8_t [double_rows_ * kBitPlanes];
+  memset(plane_repeats_, 0, double_rows_ * kBitPlanes);
+  if (optimize_static_content) {
+    shadow_ = new uint8_t [width_ * height_ * 3];
+  }
+
   Clear();
 }
 
 RGBMatrix::Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete [] packed_buffer_;
+  delete [] positions_;
+  delete [] row_partner_;
+  delete [] row_dirty_;
+  delete [] shadow_;
+  delete [] plane_repeats_;
 }
 
-/* statuc */ void RGBMatrix::Framebuffer::InitGPIO(GPIO *io) {
+void RGBMatrix::Framebuffer::InitGPIO(OutputBackend *io) const {
   // Tell GPIO about all bits we intend to use.
   IoBits b;
   b.raw = 0;
   b.bits.output_enable_rev1 = b.bits.output_enable_rev2 = 1;
   b.bits.clock_rev1 = b.bits.clock_rev2 = 1;
   b.bits.strobe = 1;
-  b.bits.r1 = b.bits.g1 = b.bits.b1 = 1;
-  b.bits.r2 = b.bits.g2 = b.bits.b2 = 1;
-  b.bits.row = 0x0f;
+  b.raw |= RowAddressMask();
+  for (int chain = 0; chain < parallel_; ++chain) {
+    for (int i = 0; i < 6; ++i) b.raw |= color_bits_[chain][i];
+  }
   // Initialize outputs, make sure that all of these are supported bits.
   const uint32_t result = io->InitOutputs(b.raw);
   assert(result == b.raw);
 }
 
+uint32_t RGBMatrix::Framebuffer::RowAddressMask() const {
+  // The E line is only needed with more than 16 row addresses; leave the
+  // pin alone otherwise.
+  IoBits b;
+  b.bits.row = (double_rows_ > 16) ? 0x1f : 0x0f;
+  return b.raw;
+}
+
 bool RGBMatrix::Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
+  // With temporal dithering, all bitplanes are filled anyway.
+  const bool needs_update = (value != pwm_bits_ && !temporal_dithering_);
   pwm_bits_ = value;
+  if (shadow_ && needs_update) {
+    // We have the pixels, so we can fill in the bitplanes now in use.
+    ConvertPixels(0, 0, width_, height(), shadow_, width_ * 3);
+  }
   return true;
 }
 
-inline RGBMatrix::Framebuffer::IoBits *
-RGBMatrix::Framebuffer::ValueAt(int double_row, int column, int bit) {
+bool RGBMatrix::Framebuffer::SetBrightness(uint8_t percent) {
+  if (percent > 100)
+    return false;
+  __atomic_store_n(&brightness_, percent, __ATOMIC_RELAXED);
+  return true;
+}
+
+void RGBMatrix::Framebuffer::SetScanOffset(int offset) {
+  offset %= columns_;
+  if (offset < 0) offset += columns_;
+  __atomic_store_n(&scan_offset_, offset, __ATOMIC_RELAXED);
+}
+
+inline void RGBMatrix::Framebuffer::MapPosition(int x, int y,
+                                                int *column, int *row) const {
+  if (multiplexing_ == kDirectMultiplexing) {
+    *column = x;
+    *row = y;
+    return;
+  }
+  // Each panel of 32 x chain_rows_ is 64 x chain_rows_ / 2 in the shift
+  // registers: the upper and lower quarter of each half of the panel share
+  // the row address.
+  enum { kPanelColumns = 32 };
+  const int half = chain_rows_ / 2;
+  const int quarter = chain_rows_ / 4;
+  const bool is_upper_quarter = (y % half) < quarter;
+  const int panel_start = 2 * kPanelColumns * (x / kPanelColumns);
+  const int panel_x = x % kPanelColumns;
+  if (multiplexing_ == kStripeMultiplexing) {
+    *column = panel_start + panel_x + (is_upper_quarter ? kPanelColumns : 0);
+  } else {
+    const bool is_left = panel_x < kPanelColumns / 2;
+    int offset;
+    if (is_upper_quarter)
+      offset = is_left ? kPanelColumns / 2 : kPanelColumns;
+    else
+      offset = is_left ? 0 : kPanelColumns / 2;
+    *column = panel_start + panel_x + offset;
+  }
+  *row = (y / half) * quarter + y % quarter;
+}
+
+void RGBMatrix::Framebuffer::FindRowPartners() {
+  // Which visible pixel is at each position in the bitplanes.
+  const int positions = 2 * parallel_ * double_rows_ * columns_;
+  int *const pixel_at = new int [positions];
+  for (int i = 0; i < positions; ++i) pixel_at[i] = -1;
+  for (int i = 0; i < width_ * height_; ++i) {
+    const PixelPosition &pos = positions_[i];
+    if (pos.sub_panel == PixelPosition::kNotShown) continue;
+    pixel_at[(pos.sub_panel * double_rows_ + pos.double_row) * columns_
+             + pos.column] = i;
+  }
+
+  row_partner_ = new int [height_];
+  for (int y = 0; y < height_; ++y) {
+    row_partner_[y] = -1;
+    const PixelPosition *const row = &positions_[y * width_];
+    int x = 0;
+    while (x < width_ && row[x].sub_panel == PixelPosition::kNotShown) ++x;
+    if (x == width_) continue;
+    // The pixel in the other half, and whether the whole row matches.
+    const int other = pixel_at[((row[x].sub_panel ^ 1) * double_rows_
+                                + row[x].double_row) * columns_
+                               + row[x].column];
+    if (other < 0 || other % width_ != x) continue;
+    const PixelPosition *const partner = &positions_[other - x];
+    bool matches = true;
+    for (x = 0; x < width_ && matches; ++x) {
+      if (row[x].sub_panel == PixelPosition::kNotShown) {
+        matches = (partner[x].sub_panel == PixelPosition::kNotShown);
+      } else {
+        matches = (partner[x].sub_panel == (row[x].sub_panel ^ 1)
+                   && partner[x].double_row == row[x].double_row
+                   && partner[x].column == row[x].column);
+      }
+    }
+    if (matches) row_partner_[y] = other / width_;
+  }
+  delete [] pixel_at;
+}
+
+inline IoBits *RGBMatrix::Framebuffer::ValueAt(int double_row, int column,
+                                               int bit) const {
   return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
                             + bit * columns_
                             + column ];
 }
 
+inline const uint8_t *RGBMatrix::Framebuffer::PlaneData(int double_row,
+                                                       int bit) {
+  if (packed_buffer_)
+    return PackedAt(0, double_row, 0, bit);
+  return reinterpret_cast<const uint8_t*>(ValueAt(double_row, 0, bit));
+}
+
+inline uint8_t *RGBMatrix::Framebuffer::PackedAt(int chain, int double_row,
+                                                 int column, int bit) const {
+  return &packed_buffer_[ double_row * (columns_ * parallel_ * kBitPlanes)
+                          + bit * (columns_ * parallel_)
+                          + chain * columns_
+                          + column ];
+}
+
 // Do CIE1931 luminance correction and scale to output bitplanes
 static uint16_t luminance_cie1931(uint8_t c) {
   float out_factor = ((1 << kBitPlanes) - 1);
@@ -112,53 +330,100 @@ static uint16_t luminance_cie1931(uint8_t c) {
   return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
 }
 
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+#  define COLOR_OUT_BITS(x) (x) ^ 0xffff
+#else
+#  define COLOR_OUT_BITS(x) (x)
+#endif
+
 static uint16_t *CreateLuminanceCIE1931LookupTable() {
   uint16_t *result = new uint16_t [ 256 ];
   for (int i = 0; i < 256; ++i)
-    result[i] = luminance_cie1931(i);
+    result[i] = COLOR_OUT_BITS(luminance_cie1931(i)) >> 2;
   return result;
 }
 
-inline uint16_t RGBMatrix::Framebuffer::MapColor(uint8_t c) {
-#ifdef INVERSE_RGB_DISPLAY_COLORS
-#  define COLOR_OUT_BITS(x) (x) ^ 0xffff
-#else
-#  define COLOR_OUT_BITS(x) (x)
-#endif
+static uint16_t *CreateLinearLookupTable() {
+  enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
+  uint16_t *result = new uint16_t [ 256 ];
+  for (int i = 0; i < 256; ++i)
+    result[i] = COLOR_OUT_BITS((shift > 0) ? (i << shift) : (i >> -shift));
+  return result;
+}
 
-  if (do_luminance_correct_) {
-    // We're leaking this table. So be it :)
-    static uint16_t *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-    return COLOR_OUT_BITS(luminance_lookup[c])>>2;
-  } else {
-    enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
-    return COLOR_OUT_BITS((shift > 0) ? (c << shift) : (c >> -shift));
+#undef COLOR_OUT_BITS
+
+void RGBMatrix::Framebuffer::UpdateColorTables() {
+  // The base tables are computed once; we're leaking them. So be it :)
+  static const uint16_t *luminance_lookup = CreateLuminanceCIE1931LookupTable();
+  static const uint16_t *linear_lookup = CreateLinearLookupTable();
+  const uint16_t *const lut = (do_luminance_correct_
+                               ? luminance_lookup : linear_lookup);
+  for (int c = 0; c < 256; ++c) {
+    color_lut_[c] = lut[c];
+    color_spread_[c] = 0;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      if (lut[c] & (1 << b)) color_spread_[c] |= uint64_t(1) << (3 * b);
+    }
   }
+}
 
-#undef COLOR_OUT_BITS
+void RGBMatrix::Framebuffer::set_luminance_correct(bool on) {
+  if (on == do_luminance_correct_)
+    return;
+  do_luminance_correct_ = on;
+  UpdateColorTables();
+  if (shadow_) {
+    // We have the pixels, so we can show them with the new mapping.
+    ConvertPixels(0, 0, width_, height(), shadow_, width_ * 3);
+  }
 }
 
 void RGBMatrix::Framebuffer::Clear() {
 #ifdef INVERSE_RGB_DISPLAY_COLORS
   Fill(0, 0, 0);
 #else
-  memset(bitplane_buffer_, 0,
-         sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+  if (packed_buffer_) {
+    memset(packed_buffer_, 0,
+           double_rows_ * columns_ * parallel_ * kBitPlanes);
+  } else {
+    memset(bitplane_buffer_, 0,
+           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+  }
+  if (shadow_) memset(shadow_, 0, height() * width_ * 3);
+  for (int row = 0; row < double_rows_; ++row) MarkChanged(row);
 #endif
 }
 
 void RGBMatrix::Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
+  const uint64_t planes = ColorPlanes(r, g, b);
+
+  if (shadow_) {
+    for (uint8_t *pixel = shadow_; pixel < shadow_ + height() * width_ * 3;
+         pixel += 3) {
+      pixel[0] = r; pixel[1] = g; pixel[2] = b;
+    }
+  }
 
-  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
-    uint16_t mask = 1 << b;
+  if (packed_buffer_) {
+    for (int b = FirstFilledPlane(); b < kBitPlanes; ++b) {
+      const uint8_t color = (planes >> (3 * b)) & 0x07;
+      for (int row = 0; row < double_rows_; ++row) {
+        memset(PackedAt(0, row, 0, b), color | color << 3,
+               columns_ * parallel_);
+      }
+    }
+    for (int row = 0; row < double_rows_; ++row) MarkChanged(row);
+    return;
+  }
+
+  for (int b = FirstFilledPlane(); b < kBitPlanes; ++b) {
+    const int color = (planes >> (3 * b)) & 0x07;
     IoBits plane_bits;
-    plane_bits.raw = 0;
-    plane_bits.bits.r1 = plane_bits.bits.r2 = (red & mask) == mask;
-    plane_bits.bits.g1 = plane_bits.bits.g2 = (green & mask) == mask;
-    plane_bits.bits.b1 = plane_bits.bits.b2 = (blue & mask) == mask;
+    for (int chain = 0; chain < parallel_; ++chain) {
+      plane_bits.raw |= (color_words_[chain][0][color]
+                         | color_words_[chain][1][color]);
+    }
     for (int row = 0; row < double_rows_; ++row) {
       IoBits *row_data = ValueAt(row, 0, b);
       for (int col = 0; col < columns_; ++col) {
@@ -166,45 +431,493 @@ void RGBMatrix::Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
       }
     }
   }
+  for (int row = 0; row < double_rows_; ++row) MarkChanged(row);
 }
 
 void RGBMatrix::Framebuffer::SetPixel(int x, int y,
                                       uint8_t r, uint8_t g, uint8_t b) {
-  if (x < 0 || x >= columns_ || y < 0 || y >= rows_) return;
+  if (x < 0 || x >= width_ || y < 0 || y >= height()) return;
+
+  if (shadow_) {
+    uint8_t *pixel = &shadow_[(y * width_ + x) * 3];
+    if (pixel[0] == r && pixel[1] == g && pixel[2] == b)
+      return;  // Already there.
+    pixel[0] = r; pixel[1] = g; pixel[2] = b;
+  }
 
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
+  SetPixelPlanes(x, y, ColorPlanes(r, g, b));
+}
 
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  IoBits *bits = ValueAt(y & row_mask_, x, min_bit_plane);
-  if (y < double_rows_) {   // Upper sub-panel.
+inline void RGBMatrix::Framebuffer::SetPixelPlanes(int x, int y,
+                                                   uint64_t planes) {
+  int chain, double_row;
+  bool is_upper;
+  if (positions_) {
+    const PixelPosition &pos = positions_[y * width_ + x];
+    if (pos.sub_panel == PixelPosition::kNotShown) return;
+    chain = pos.sub_panel / 2;
+    is_upper = (pos.sub_panel % 2 == 0);
+    double_row = pos.double_row;
+    x = pos.column;
+  } else {
+    chain = y / chain_rows_;
+    const int panel_row = y % chain_rows_;  // Row within the chain.
+    is_upper = (panel_row < double_rows_);
+    double_row = panel_row & row_mask_;
+  }
+  const int min_bit_plane = FirstFilledPlane();
+  if (packed_buffer_) {
+    uint8_t *bits = PackedAt(chain, double_row, x, min_bit_plane);
+    const int shift = is_upper ? 0 : 3;
+    const uint8_t keep = ~(0x07 << shift);
     for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-      const uint16_t mask = 1 << b;
-      bits->bits.r1 = (red & mask) == mask;
-      bits->bits.g1 = (green & mask) == mask;
-      bits->bits.b1 = (blue & mask) == mask;
-      bits += columns_;
+      const uint8_t color = (planes >> (3 * b)) & 0x07;
+      *bits = (*bits & keep) | (color << shift);
+      bits += columns_ * parallel_;
+    }
+    MarkChanged(double_row);
+    return;
+  }
+
+  const uint32_t *const words = color_words_[chain][is_upper ? 0 : 1];
+  const uint32_t keep = ~words[0x07];
+  IoBits *bits = ValueAt(double_row, x, min_bit_plane);
+  for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+    bits->raw = (bits->raw & keep) | words[(planes >> (3 * b)) & 0x07];
+    bits += columns_;
+  }
+  MarkChanged(double_row);
+}
+
+void RGBMatrix::Framebuffer::SetBitmap(int x, int y, int width, int height,
+                                       const uint32_t *rows,
+                                       const uint8_t *foreground,
+                                       const uint8_t *background) {
+  // Clip to our area; the bits of clipped columns are shifted out.
+  int first_column = 0;
+  if (width > 32) width = 32;
+  if (x < 0) { first_column = -x; width += x; x = 0; }
+  if (y < 0) { rows -= y; height += y; y = 0; }
+  if (x + width > width_) width = width_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+
+  for (int row = 0; row < height; ++row) {
+    SetBitmapRow(x, y + row, rows[row] << first_column, width,
+                 foreground, background);
+  }
+}
+
+void RGBMatrix::Framebuffer::SetBitmapRow(int x, int y, uint32_t row,
+                                          int width,
+                                          const uint8_t *foreground,
+                                          const uint8_t *background) {
+  if (shadow_) {
+    bool changed = false;
+    uint8_t *pixel = &shadow_[(y * width_ + x) * 3];
+    uint32_t mask = 0x80000000;
+    for (int i = 0; i < width; ++i, mask >>= 1, pixel += 3) {
+      const uint8_t *color = (row & mask) ? foreground : background;
+      if (color && (pixel[0] != color[0] || pixel[1] != color[1]
+                    || pixel[2] != color[2])) {
+        pixel[0] = color[0]; pixel[1] = color[1]; pixel[2] = color[2];
+        changed = true;
+      }
+    }
+    if (!changed) return;  // Already there.
+  }
+
+  // The colors are mapped once for the whole row. Only the pixels to be
+  // written are visited: without background, just the bits that are set.
+  const uint64_t fg_planes = ColorPlanes(foreground[0], foreground[1],
+                                         foreground[2]);
+  const uint64_t bg_planes = (background
+                              ? ColorPlanes(background[0], background[1],
+                                            background[2])
+                              : 0);
+  const uint32_t in_width = ~0u << (32 - width);
+  row &= in_width;
+  uint32_t todo = background ? in_width : row;
+  if (positions_) {
+    // Arbitrary positions: pixel by pixel.
+    while (todo) {
+      const int i = __builtin_clz(todo);
+      const uint32_t mask = 0x80000000u >> i;
+      todo &= ~mask;
+      SetPixelPlanes(x + i, y, (row & mask) ? fg_planes : bg_planes);
+    }
+    return;
+  }
+
+  // The pixels of a row are consecutive columns of the same double-row, so
+  // where they are is only worked out once.
+  const int chain = y / chain_rows_;
+  const int panel_row = y % chain_rows_;  // Row within the chain.
+  const bool is_upper = (panel_row < double_rows_);
+  const int double_row = panel_row & row_mask_;
+  const int min_bit_plane = FirstFilledPlane();
+  if (packed_buffer_) {
+    uint8_t *const first = PackedAt(chain, double_row, x, min_bit_plane);
+    const int shift = is_upper ? 0 : 3;
+    const uint8_t keep = ~(0x07 << shift);
+    while (todo) {
+      const int i = __builtin_clz(todo);
+      const uint32_t mask = 0x80000000u >> i;
+      todo &= ~mask;
+      const uint64_t planes = (row & mask) ? fg_planes : bg_planes;
+      uint8_t *bits = first + i;
+      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+        const uint8_t color = (planes >> (3 * b)) & 0x07;
+        *bits = (*bits & keep) | (color << shift);
+        bits += columns_ * parallel_;
+      }
     }
   } else {
-    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-      const uint16_t mask = 1 << b;
-      bits->bits.r2 = (red & mask) == mask;
-      bits->bits.g2 = (green & mask) == mask;
-      bits->bits.b2 = (blue & mask) == mask;
-      bits += columns_;
+    const uint32_t *const words = color_words_[chain][is_upper ? 0 : 1];
+    const uint32_t keep = ~words[0x07];
+    IoBits *const first = ValueAt(double_row, x, min_bit_plane);
+    while (todo) {
+      const int i = __builtin_clz(todo);
+      const uint32_t mask = 0x80000000u >> i;
+      todo &= ~mask;
+      const uint64_t planes = (row & mask) ? fg_planes : bg_planes;
+      IoBits *bits = first + i;
+      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+        bits->raw = (bits->raw & keep) | words[(planes >> (3 * b)) & 0x07];
+        bits += columns_;
+      }
+    }
+  }
+  MarkChanged(double_row);
+}
+
+bool RGBMatrix::Framebuffer::CopyColumns(const Framebuffer &other,
+                                         int from_x, int x, int width) {
+  assert(positions_ == NULL && other.positions_ == NULL);
+  assert(rows_ == other.rows_ && parallel_ == other.parallel_
+         && bitplane_layout_ == other.bitplane_layout_);
+  if (other.FirstFilledPlane() > FirstFilledPlane()
+      || other.do_luminance_correct_ != do_luminance_correct_
+      || (shadow_ && !other.shadow_)) {
+    return false;
+  }
+  // Clip to both.
+  if (x < 0) { from_x -= x; width += x; x = 0; }
+  if (from_x < 0) { x -= from_x; width += from_x; from_x = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (from_x + width > other.columns_) width = other.columns_ - from_x;
+  if (width <= 0) return true;
+
+  for (int row = 0; row < double_rows_; ++row) {
+    for (int b = FirstFilledPlane(); b < kBitPlanes; ++b) {
+      if (packed_buffer_) {
+        for (int chain = 0; chain < parallel_; ++chain) {
+          memcpy(PackedAt(chain, row, x, b),
+                 other.PackedAt(chain, row, from_x, b), width);
+        }
+      } else {
+        memcpy(ValueAt(row, x, b), other.ValueAt(row, from_x, b),
+               width * sizeof(IoBits));
+      }
     }
+    MarkChanged(row);
   }
+  if (shadow_) {
+    for (int y = 0; y < height_; ++y) {
+      memcpy(&shadow_[(y * width_ + x) * 3],
+             &other.shadow_[(y * other.width_ + from_x) * 3], width * 3);
+    }
+  }
+  return true;
 }
 
-void RGBMatrix::Framebuffer::DumpToMatrix(GPIO *io) {
+void RGBMatrix::Framebuffer::SetPixels(int x, int y, int width, int height,
+                                       const uint8_t *rgb_data, int stride) {
+  // Clip to our area.
+  if (x < 0) { rgb_data -= 3 * x; width += x; x = 0; }
+  if (y < 0) { rgb_data -= stride * y; height += y; y = 0; }
+  if (x + width > width_) width = width_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+
+  if (shadow_ == NULL) {
+    ConvertPixels(x, y, width, height, rgb_data, stride);
+    return;
+  }
+
+  if (positions_) {
+    // The rows of a double-row are spread out, so just convert each row
+    // that changed.
+    for (int row = y; row < y + height; ++row) {
+      const uint8_t *line = rgb_data + (row - y) * stride;
+      uint8_t *shadow_line = &shadow_[(row * width_ + x) * 3];
+      if (memcmp(shadow_line, line, width * 3) != 0) {
+        memcpy(shadow_line, line, width * 3);
+        ConvertMappedRow(x, row, width, line, NULL);
+      }
+    }
+    return;
+  }
+
+  // Only convert the double-rows in which a pixel changed. As the shadow
+  // has the current content of both rows, convert from there.
+  const int y_end = y + height;
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    bool row_changed = false;
+    for (int chain = 0; chain < parallel_; ++chain) {
+      bool chain_changed = false;
+      for (int row = chain * chain_rows_ + d_row;
+           row < (chain + 1) * chain_rows_; row += double_rows_) {
+        if (row < y || row >= y_end) continue;
+        const uint8_t *line = rgb_data + (row - y) * stride;
+        uint8_t *shadow_line = &shadow_[(row * width_ + x) * 3];
+        if (memcmp(shadow_line, line, width * 3) != 0) {
+          memcpy(shadow_line, line, width * 3);
+          chain_changed = true;
+        }
+      }
+      if (!chain_changed)
+        continue;
+      const uint8_t *upper = &shadow_[((chain * chain_rows_ + d_row) * width_
+                                       + x) * 3];
+      const uint8_t *lower = upper + double_rows_ * width_ * 3;
+      MapRows(chain, d_row, x, upper, lower, width);
+      row_changed = true;
+    }
+    if (row_changed) MarkChanged(d_row);
+  }
+}
+
+void RGBMatrix::Framebuffer::ConvertPixels(int x, int y, int width, int height,
+                                           const uint8_t *rgb_data,
+                                           int stride) {
+  const int y_end = y + height;
+  if (positions_) {
+    for (int row = y; row < y_end; ++row) {
+      const uint8_t *const line = rgb_data + (row - y) * stride;
+      const int partner = row_partner_[row];
+      if (partner >= y && partner < y_end) {
+        if (partner < row)
+          continue;  // Already done together with the partner.
+        ConvertMappedRow(x, row, width, line,
+                         rgb_data + (partner - y) * stride);
+      } else {
+        ConvertMappedRow(x, row, width, line, NULL);
+      }
+    }
+    return;
+  }
+
+  for (int row = y; row < y_end; ++row) {
+    const uint8_t *const line = rgb_data + (row - y) * stride;
+    const int panel_row = row % chain_rows_;  // Row within the chain.
+    const uint8_t *upper = NULL;
+    const uint8_t *lower = NULL;
+    if (panel_row < double_rows_) {
+      upper = line;
+      // If we have the row of the lower sub-panel as well, do it in the same
+      // pass: then each bitplane word is written only once.
+      if (row + double_rows_ < y_end)
+        lower = line + double_rows_ * stride;
+    } else {
+      if (row - double_rows_ >= y)
+        continue;  // Already done together with the upper row.
+      lower = line;
+    }
+    MapRows(row / chain_rows_, panel_row & row_mask_, x, upper, lower, width);
+    MarkChanged(panel_row & row_mask_);
+  }
+}
+
+void RGBMatrix::Framebuffer::ConvertMappedRow(int x, int y, int width,
+                                              const uint8_t *pixels,
+                                              const uint8_t *partner_pixels) {
+  // Pixels that are next to each other in the row usually are in the shift
+  // registers as well, maybe in reverse (e.g. on panels mounted upside
+  // down). Convert such runs in one go.
+  enum { kMaxReverseRun = 64 };
+  uint8_t reversed[3 * kMaxReverseRun];
+  uint8_t partner_reversed[3 * kMaxReverseRun];
+  const PixelPosition *const pos = &positions_[y * width_ + x];
+  for (int i = 0; i < width; /**/) {
+    const PixelPosition &first = pos[i];
+    if (first.sub_panel == PixelPosition::kNotShown) {
+      ++i;
+      continue;
+    }
+    int step = 0;  // Direction in the shift registers: 1, -1 or 0.
+    if (i + 1 < width && pos[i + 1].sub_panel == first.sub_panel
+        && pos[i + 1].double_row == first.double_row) {
+      step = pos[i + 1].column - first.column;
+      if (step != 1 && step != -1) step = 0;
+    }
+    int count = 1;
+    if (step != 0) {
+      while (i + count < width
+             && (step > 0 || count < kMaxReverseRun)
+             && pos[i + count].sub_panel == first.sub_panel
+             && pos[i + count].double_row == first.double_row
+             && pos[i + count].column == first.column + count * step) {
+        ++count;
+      }
+    }
+    const uint8_t *run = pixels + 3 * i;
+    const uint8_t *partner_run = partner_pixels ? partner_pixels + 3 * i : NULL;
+    int column = first.column;
+    if (step < 0) {
+      for (int k = 0; k < count; ++k) {
+        memcpy(reversed + 3 * k, run + 3 * (count - 1 - k), 3);
+        if (partner_run) {
+          memcpy(partner_reversed + 3 * k, partner_run + 3 * (count - 1 - k),
+                 3);
+        }
+      }
+      run = reversed;
+      if (partner_run) partner_run = partner_reversed;
+      column -= count - 1;
+    }
+    const bool is_upper = (first.sub_panel % 2 == 0);
+    MapRows(first.sub_panel / 2, first.double_row, column,
+            is_upper ? run : partner_run, is_upper ? partner_run : run, count);
+    MarkChanged(first.double_row);
+    i += count;
+  }
+}
+
+void RGBMatrix::Framebuffer::MapRows(int chain, int double_row, int x,
+                                     const uint8_t *upper,
+                                     const uint8_t *lower, int width) {
+  const int min_bit_plane = FirstFilledPlane();
+  if (packed_buffer_) {
+    MapToBitplanes(packed_layout_, color_lut_, upper, lower, width,
+                   min_bit_plane, kBitPlanes,
+                   PackedAt(chain, double_row, x, 0), columns_ * parallel_);
+  } else {
+    MapToBitplanes(color_layout_[chain], color_lut_, upper, lower, width,
+                   min_bit_plane, kBitPlanes,
+                   &ValueAt(double_row, x, 0)->raw, columns_);
+  }
+}
+
+bool RGBMatrix::Framebuffer::IsDarkPlane(int double_row, int bit) {
+  if (packed_buffer_) {
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+    const uint8_t packed_off = 0x3f;  // The color bits are low for "on".
+#else
+    const uint8_t packed_off = 0;
+#endif
+    const uint8_t *plane = PackedAt(0, double_row, 0, bit);
+    for (int i = 0; i < columns_ * parallel_; ++i) {
+      if (plane[i] != packed_off) return false;
+    }
+  } else {
+    uint32_t color_mask = 0;
+    for (int chain = 0; chain < parallel_; ++chain) {
+      for (int i = 0; i < 6; ++i) color_mask |= color_bits_[chain][i];
+    }
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+    const uint32_t color_off = color_mask;
+#else
+    const uint32_t color_off = 0;
+#endif
+    const IoBits *plane = ValueAt(double_row, 0, bit);
+    for (int i = 0; i < columns_; ++i) {
+      if ((plane[i].raw & color_mask) != color_off) return false;
+    }
+  }
+  return true;
+}
+
+void RGBMatrix::Framebuffer::UpdatePlaneRepeats() {
+  const int plane_bytes = (packed_buffer_
+                           ? columns_ * parallel_
+                           : columns_ * sizeof(IoBits));
+  bool previous_dirty = false;
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    // Pairs with the release in MarkChanged(): we see the new content.
+    const bool dirty = __atomic_exchange_n(&row_dirty_[d_row], 0,
+                                           __ATOMIC_ACQUIRE);
+    // The first plane depends on the row before as well.
+    if (dirty || previous_dirty) {
+      const uint8_t *previous_row_last = (d_row > 0)
+        ? PlaneData(d_row - 1, kBitPlanes - 1) : NULL;
+      const uint8_t *previous_plane = NULL;
+      for (int b = 0; b < kBitPlanes; ++b) {
+        const uint8_t *plane = PlaneData(d_row, b);
+        uint8_t repeats = 0;
+        if (IsDarkPlane(d_row, b))
+          repeats |= kDarkPlane;
+        if (previous_plane && memcmp(plane, previous_plane, plane_bytes) == 0)
+          repeats |= kSameAsPreviousPlane;
+        if (previous_row_last
+            && memcmp(plane, previous_row_last, plane_bytes) == 0)
+          repeats |= kSameAsPreviousRow;
+        plane_repeats_[d_row * kBitPlanes + b] = repeats;
+        previous_plane = plane;
+      }
+    }
+    previous_dirty = dirty;
+  }
+}
+
+namespace {
+// The real hardware. Calls the GPIO methods directly instead of through the
+// virtual functions, so that they are inlined in the loops below.
+class HardwareOutput {
+public:
+  explicit HardwareOutput(GPIO *io) : io_(io) {}
+  inline void SetBits(uint32_t value) { io_->GPIO::SetBits(value); }
+  inline void ClearBits(uint32_t value) { io_->GPIO::ClearBits(value); }
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    io_->GPIO::WriteMaskedBits(value, mask);
+  }
+  inline long SleepNanos(long nanos) { return io_->GPIO::SleepNanos(nanos); }
+
+private:
+  GPIO *const io_;
+};
+
+// Any other OutputBackend.
+class VirtualOutput {
+public:
+  explicit VirtualOutput(OutputBackend *io) : io_(io) {}
+  inline void SetBits(uint32_t value) { io_->SetBits(value); }
+  inline void ClearBits(uint32_t value) { io_->ClearBits(value); }
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    io_->WriteMaskedBits(value, mask);
+  }
+  inline long SleepNanos(long nanos) { return io_->SleepNanos(nanos); }
+
+private:
+  OutputBackend *const io_;
+};
+}  // anonymous namespace
+
+void RGBMatrix::Framebuffer::DumpToMatrix(OutputBackend *io,
+                                          BitplaneTiming *timing) {
+  __atomic_store_n(&changed_, false, __ATOMIC_RELEASE);
+  UpdatePlaneRepeats();
+
+  GPIO *const gpio = dynamic_cast<GPIO*>(io);
+  if (gpio) {
+    HardwareOutput out(gpio);
+    DumpToOutput(&out, timing);
+  } else {
+    VirtualOutput out(io);
+    DumpToOutput(&out, timing);
+  }
+}
+
+template <class Output>
+void RGBMatrix::Framebuffer::DumpToOutput(Output *io, BitplaneTiming *timing) {
   IoBits color_clk_mask;   // Mask of bits we need to set while clocking in.
-  color_clk_mask.bits.r1 = color_clk_mask.bits.g1 = color_clk_mask.bits.b1 = 1;
-  color_clk_mask.bits.r2 = color_clk_mask.bits.g2 = color_clk_mask.bits.b2 = 1;
+  for (int chain = 0; chain < parallel_; ++chain) {
+    for (int i = 0; i < 6; ++i) color_clk_mask.raw |= color_bits_[chain][i];
+  }
   color_clk_mask.bits.clock_rev1 = color_clk_mask.bits.clock_rev2 = 1;
 
   IoBits row_mask;
-  row_mask.bits.row = 0x0f;
+  row_mask.raw = RowAddressMask();
 
   IoBits clock, output_enable, strobe, row_address;
   clock.bits.clock_rev1 = clock.bits.clock_rev2 = 1;
@@ -212,32 +925,147 @@ void RGBMatrix::Framebuffer::DumpToMatrix(GPIO *io) {
   output_enable.bits.output_enable_rev2 = 1;
   strobe.bits.strobe = 1;
 
+  // Where the columns come from while clocking in (see SetScanOffset()):
+  // starting at the offset, wrapping around at the end, backwards when
+  // mirrored. Local copies; the next refresh picks up changes.
+  const int offset = scan_offset();
+  const uint8_t mirror = scan_mirror();
+  const bool mirror_rows = (mirror & kMirrorVertical);
+  const int step = (mirror & kMirrorHorizontal) ? -1 : 1;
+  const int first_column = (step < 0) ? (offset + columns_ - 1) % columns_
+                                      : offset;
+  const uint32_t (*const expand)[64]
+    = mirror_rows ? packed_swapped_expand_ : packed_expand_;
+
   const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
+  const int first_plane = kBitPlanes - pwm_to_show;
+
+  // The bitplanes of each row, in the order they are shown, and how long.
+  int shown[kBitPlanes + 1];
+  long slot_nanos[kBitPlanes + 1];
+  int shown_count = 0;
+
+  // Temporal dithering: the planes below the PWM bits take turns in an
+  // extra slot as long as the lowest plane shown; plane j in 2^j of
+  // 2^first_plane refreshes, evenly spread, and the slot stays dark in the
+  // remaining one (-1). On average, each is lit for its own time, so we get
+  // the full color depth at the cost of one plane.
+  const bool dither_slot = (temporal_dithering_ && first_plane > 0);
+  if (dither_slot) {
+    const unsigned int pass = dither_pass_++ & ((1 << first_plane) - 1);
+    shown[shown_count] = (pass == 0
+                          ? -1 : first_plane - 1 - __builtin_ctz(pass));
+    slot_nanos[shown_count++] = bitplane_nanos_[first_plane];
+  }
+  for (int b = first_plane; b < kBitPlanes; ++b) {
+    shown[shown_count] = b;
+    slot_nanos[shown_count++] = bitplane_nanos_[b];
+  }
+
+  // Dimming only shortens the time the LEDs are lit; the bitplane stays
+  // dark for the rest of its time. So the refresh rate stays the same and
+  // the brightness is proportional to the setting, at full color depth.
+  const int percent = brightness();  // Local copy, might change in process.
+  long on_nanos[kBitPlanes + 1];
+  for (int i = 0; i < shown_count; ++i) {
+    on_nanos[i] = slot_nanos[i] * percent / 100;
+  }
   for (uint8_t d_row = 0; d_row < double_rows_; ++d_row) {
     row_address.bits.row = d_row;
     io->WriteMaskedBits(row_address.raw, row_mask.raw);  // Set row address
+    // Mirrored vertically, the upper half shows the lower half of the
+    // double-row at the other end, and vice versa.
+    const int data_row = mirror_rows ? double_rows_ - 1 - d_row : d_row;
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
-    for (int b = kBitPlanes - pwm_to_show; b < kBitPlanes; ++b) {
-      IoBits *row_data = ValueAt(d_row, 0, b);
-      // We clock these in while we are dark. This actually increases the
-      // dark time, but we ignore that a bit.
-      for (int col = 0; col < columns_; ++col) {
-        const IoBits &out = *row_data++;
-        io->WriteMaskedBits(out.raw, color_clk_mask.raw);  // col + reset clock
-        io->SetBits(clock.raw);               // Rising edge: clock color in.
+    int planes_clocked_in = 0;
+    bool dither_clocked_in = false;
+    for (int i = 0; i < shown_count; ++i) {
+      const int b = shown[i];
+      const uint8_t repeats = (b < 0
+                               ? kDarkPlane
+                               : plane_repeats_[data_row * kBitPlanes + b]);
+      if (repeats & kDarkPlane) {
+        // Nothing to light up: no need to clock it in, just stay dark for
+        // its time. Whatever is left in the latches is not shown.
+        const long dark_nanos = io->SleepNanos(slot_nanos[i]);
+        if (timing) timing->dark_nanos += dark_nanos;
+        continue;
+      }
+
+      // If the columns are the same as the ones clocked in before, they are
+      // still in the shift registers and latches of the panels. A plane
+      // before that was dark is not clocked in, but then this plane would
+      // be dark as well. The dither slot is always clocked in. Mirrored
+      // vertically, the row before is another one.
+      bool already_there;
+      if (dither_slot && i == 0) {
+        already_there = false;
+      } else if (b > first_plane) {
+        already_there = (repeats & kSameAsPreviousPlane);
+      } else {
+        already_there = (!dither_clocked_in && !mirror_rows
+                         && (repeats & kSameAsPreviousRow));
       }
+      if (!already_there) {
+        // We clock these in while we are dark. This actually increases the
+        // dark time, but we ignore that a bit.
+        int col = first_column;
+        if (packed_buffer_) {
+          // The chains are clocked in at the same time, one word each column.
+          const uint8_t *row_data = PackedAt(0, data_row, 0, b);
+          for (int i = 0; i < columns_; ++i) {
+            uint32_t value = expand[0][row_data[col]];
+            for (int chain = 1; chain < parallel_; ++chain) {
+              value |= expand[chain][row_data[chain * columns_ + col]];
+            }
+            io->WriteMaskedBits(value, color_clk_mask.raw);  // col + reset clk
+            io->SetBits(clock.raw);             // Rising edge: clock color in.
+            col += step;
+            if (col == columns_) col = 0;
+            else if (col < 0) col = columns_ - 1;
+          }
+        } else {
+          const IoBits *row_data = ValueAt(data_row, 0, b);
+          for (int i = 0; i < columns_; ++i) {
+            const uint32_t value = (mirror_rows
+                                    ? SwapHalves(row_data[col].raw)
+                                    : row_data[col].raw);
+            io->WriteMaskedBits(value, color_clk_mask.raw);  // col + reset clk
+            io->SetBits(clock.raw);             // Rising edge: clock color in.
+            col += step;
+            if (col == columns_) col = 0;
+            else if (col < 0) col = columns_ - 1;
+          }
+        }
 
-      io->ClearBits(color_clk_mask.raw);    // clock back to normal.
+        io->ClearBits(color_clk_mask.raw);    // clock back to normal.
 
-      io->SetBits(strobe.raw);   // Strobe in the previously clocked in row.
-      io->ClearBits(strobe.raw);
+        io->SetBits(strobe.raw);   // Strobe in the previously clocked in row.
+        io->ClearBits(strobe.raw);
+        ++planes_clocked_in;
+        if (dither_slot && i == 0) dither_clocked_in = true;
+      }
 
       // Now switch on for the sleep time necessary for that bit-plane.
       io->ClearBits(output_enable.raw);
-      sleep_nanos(row_sleep_nanos[b]);
+      const long lit_nanos = io->SleepNanos(on_nanos[i]);
       io->SetBits(output_enable.raw);
+      long dark_nanos = 0;
+      if (on_nanos[i] < slot_nanos[i]) {
+        dark_nanos = io->SleepNanos(slot_nanos[i] - on_nanos[i]);
+      }
+
+      if (timing) {
+        timing->error_nanos[b] += lit_nanos - on_nanos[i];
+        ++timing->count[b];
+        timing->lit_nanos += lit_nanos;
+        timing->dark_nanos += dark_nanos;
+      }
+    }
+    if (timing && planes_clocked_in > timing->max_row_planes) {
+      timing->max_row_planes = planes_clocked_in;
     }
   }
 }
@@ -22,8 +22,11 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #define PAGE_SIZE (4*1024)
 #define BLOCK_SIZE (4*1024)
 
@@ -40,11 +43,15 @@
    (1 <<  2) | (1 <<  3) | // Revision 2 accessible
    (1 <<  4) | (1 <<  7) | (1 << 8) | (1 <<  9) |
    (1 << 10) | (1 << 11) | (1 << 14) | (1 << 15)| (1 <<17) | (1 << 18)|
-   (1 << 22) | (1 << 23) | (1 << 24) | (1 << 25)| (1 << 27));
+   (1 << 22) | (1 << 23) | (1 << 24) | (1 << 25)| (1 << 27) |
+   // B+ and later: 40 pin header.
+   (1 <<  5) | (1 <<  6) | (1 << 12) | (1 << 13)| (1 << 16) |
+   (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26));
    
 
 namespace rgb_matrix {
-GPIO::GPIO() : output_bits_(0), gpio_port_(NULL) {
+GPIO::GPIO() : output_bits_(0), gpio_port_(NULL),
+               sleep_overshoot_nanos_(20000), min_sleep_nanos_(28000) {
 }
    
 uint32_t GPIO::InitOutputs(uint32_t outputs) {
@@ -54,7 +61,7 @@ uint32_t GPIO::InitOutputs(uint32_t outputs) {
   }
   outputs &= kValidBits;   // Sanitize input.
   output_bits_ = outputs;
-  for (uint32_t b = 0; b < 27; ++b) {
+  for (uint32_t b = 0; b <= 27; ++b) {
     if (outputs & (1 << b)) {
       INP_GPIO(b);   // for writing, we first need to set as input.
       OUT_GPIO(b);
@@ -88,6 +95,51 @@ bool GPIO::Init() {
   }
 
   gpio_port_ = (volatile uint32_t *)gpio_map;
+  CalibrateSleep();
   return true;
 }
+
+static inline int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void GPIO::CalibrateSleep() {
+  // The time nanosleep() takes beyond what we ask for depends on the board
+  // and the kernel (it used to be about 20usec on the first RPi). Take the
+  // median of a couple of short sleeps.
+  const int kSamples = 15;
+  const long kProbeNanos = 50000;
+  long overshoot[kSamples];
+  for (int i = 0; i < kSamples; ++i) {
+    const int64_t start = MonotonicNanos();
+    struct timespec sleep_time = { 0, kProbeNanos };
+    nanosleep(&sleep_time, NULL);
+    overshoot[i] = MonotonicNanos() - start - kProbeNanos;
+  }
+  std::sort(overshoot, overshoot + kSamples);
+  sleep_overshoot_nanos_ = std::max(0L, overshoot[kSamples / 2]);
+
+  // Sleeping only pays off if there is some time left that we don't burn.
+  min_sleep_nanos_ = sleep_overshoot_nanos_ + 8000;
+}
+
+long GPIO::SleepNanos(long nanos) {
+  const int64_t start = MonotonicNanos();
+  const int64_t deadline = start + nanos;
+  if (nanos > min_sleep_nanos_) {
+    // Sleep for the bulk of the time and busy wait the remainder; the
+    // wake-up time of nanosleep() is too imprecise for the exact deadline.
+    const long sleep_nanos = nanos - sleep_overshoot_nanos_;
+    struct timespec sleep_time = { sleep_nanos / 1000000000,
+                                   sleep_nanos % 1000000000 };
+    nanosleep(&sleep_time, NULL);
+  }
+  int64_t now;
+  while ((now = MonotonicNanos()) < deadline) {
+    // busy wait.
+  }
+  return now - start;
+}
 }  // namespace rgb_matrix
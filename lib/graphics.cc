@@ -16,14 +16,25 @@
 #include "graphics.h"
 #include "utf8-internal.h"
 
+#include <string.h>
+
 namespace rgb_matrix {
 int DrawText(Canvas *c, const Font &font,
              int x, int y, const Color &color,
              const char *utf8_text) {
+  return DrawText(c, font, x, y, color, NULL, utf8_text);
+}
+
+int DrawText(Canvas *c, const Font &font,
+             int x, int y, const Color &color, const Color *background_color,
+             const char *utf8_text) {
   const int start_x = x;
-  while (*utf8_text) {
-    const uint32_t cp = utf8_next_codepoint(utf8_text);
-    x += font.DrawGlyph(c, x, y, color, cp);
+  const char *it = utf8_text;
+  const char *const end = it + strlen(utf8_text);
+  uint32_t codepoints[64];
+  while (it < end) {
+    const int count = utf8_decode(it, end, codepoints, 64);
+    x += font.DrawGlyphs(c, x, y, color, background_color, codepoints, count);
   }
   return x - start_x;
 }
@@ -21,13 +21,10 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <sched.h>
+#include <unistd.h>
 
-#define SHOW_REFRESH_RATE 0
-
-#if SHOW_REFRESH_RATE
-# include <stdio.h>
-# include <sys/time.h>
-#endif
+#include <algorithm>
 
 #include "gpio.h"
 #include "thread.h"
@@ -35,88 +32,448 @@
 
 namespace rgb_matrix {
 
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
-  UpdateThread(RGBMatrix *matrix) : running_(true), matrix_(matrix) {}
-
-  void Stop() {
-    MutexLock l(&mutex_);
-    running_ = false;
+  UpdateThread(OutputBackend *io, FrameCanvas *initial_frame)
+    : io_(io), current_frame_(initial_frame),
+      next_frame_(NULL), frames_shown_(0), frames_dropped_(0),
+      stats_sequence_(0) {
+    assert((int)RefreshStatistics::kBitplanes == (int)kBitPlanes);
+    pthread_cond_init(&frame_done_, NULL);
+    memset(&stats_, 0, sizeof(stats_));
+  }
+  virtual ~UpdateThread() {
+    pthread_cond_destroy(&frame_done_);
   }
 
+  void Stop() { stop_.Stop(); }
+
   virtual void Run() {
-    while (running()) {
-#if SHOW_REFRESH_RATE
-      struct timeval start, end;
-      gettimeofday(&start, NULL);
-#endif
-      matrix_->UpdateScreen();
-#if SHOW_REFRESH_RATE
-      gettimeofday(&end, NULL);
-      int64_t usec = ((uint64_t)end.tv_sec * 1000000 + end.tv_usec)
-        - ((int64_t)start.tv_sec * 1000000 + start.tv_usec);
-      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-#endif
+    while (!stop_.stopped()) {
+      const int64_t start = MonotonicNanos();
+      BitplaneTiming frame_timing;
+      current_frame_->framebuffer()->DumpToMatrix(io_, &frame_timing);
+      const int64_t frame_nanos = MonotonicNanos() - start;
+
+      bool swapped = false;
+      uint64_t dropped;
+      {
+        // Frame is fully shown: vertical sync. Pick up the next frame.
+        MutexLock l(&frame_sync_);
+        if (next_frame_ != NULL) {
+          current_frame_ = next_frame_;
+          next_frame_ = NULL;
+          swapped = true;
+        }
+        ++frames_shown_;
+        dropped = frames_dropped_;
+        pthread_cond_signal(&frame_done_);
+      }
+
+      UpdateStatistics(frame_nanos, frame_timing, swapped, dropped);
+    }
+  }
+
+  // Hand over the next frame to show and wait until the currently
+  // displayed frame is finished. Returns the frame shown before. With
+  // "other" NULL, only waits; a frame another thread handed over is still
+  // shown.
+  FrameCanvas *SwapOnVSync(FrameCanvas *other) {
+    MutexLock l(&frame_sync_);
+    FrameCanvas *const previous = current_frame_;
+    if (other != NULL) {
+      if (next_frame_ != NULL)
+        ++frames_dropped_;  // Another thread's frame never made it.
+      next_frame_ = other;
+    }
+    const uint64_t frame_count = frames_shown_;
+    while (frames_shown_ == frame_count) {
+      frame_sync_.WaitOn(&frame_done_);
+    }
+    return previous;
+  }
+
+  // The statistics are guarded by a sequence lock: the refresh thread, the
+  // only writer, makes the sequence number odd while updating. Readers
+  // retry until they got a copy with the same even sequence number before
+  // and after, so they never hold up the refresh.
+  void GetStatistics(RefreshStatistics *stats) {
+    for (;;) {
+      const uint32_t before = stats_sequence_;
+      __sync_synchronize();
+      *stats = stats_;
+      __sync_synchronize();
+      if ((before & 1) == 0 && stats_sequence_ == before)
+        return;
+      sched_yield();
     }
   }
 
 private:
-  inline bool running() {
-    MutexLock l(&mutex_);
-    return running_;
+  void UpdateStatistics(int64_t frame_nanos, const BitplaneTiming &timing,
+                        bool swapped, uint64_t dropped) {
+    ++stats_sequence_;
+    __sync_synchronize();
+
+    RefreshStatistics *const s = &stats_;
+    if (s->frames == 0 || frame_nanos < s->min_frame_nanos)
+      s->min_frame_nanos = frame_nanos;
+    if (frame_nanos > s->max_frame_nanos)
+      s->max_frame_nanos = frame_nanos;
+    ++s->frames;
+    if (swapped) ++s->frames_swapped;
+    s->frames_dropped = dropped;
+
+    const int64_t hz = 1000000000LL / std::max(frame_nanos, (int64_t)1);
+    const int bucket = hz / RefreshStatistics::kHistogramBucketHz;
+    ++s->refresh_hz_histogram[std::min(
+        bucket, (int)RefreshStatistics::kHistogramBuckets - 1)];
+
+    s->display_nanos += timing.lit_nanos;
+    s->dark_nanos += timing.dark_nanos;
+    s->clock_in_nanos += std::max(frame_nanos - timing.lit_nanos
+                                  - timing.dark_nanos, (int64_t)0);
+    ++s->frames_by_planes[timing.max_row_planes];
+    s->frame_nanos_by_planes[timing.max_row_planes] += frame_nanos;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      s->bitplane_error_nanos[b] += timing.error_nanos[b];
+      s->bitplane_count[b] += timing.count[b];
+    }
+
+    __sync_synchronize();
+    ++stats_sequence_;
   }
 
-  Mutex mutex_;
-  bool running_;
-  RGBMatrix *const matrix_;
+  StopRequest stop_;   // Checked once per refresh, without locking.
+  OutputBackend *const io_;
+
+  // Frame handover between the refresh thread and SwapOnVSync().
+  // current_frame_ is only modified in the refresh thread.
+  Mutex frame_sync_;
+  pthread_cond_t frame_done_;
+  FrameCanvas *current_frame_;
+  FrameCanvas *next_frame_;
+  uint64_t frames_shown_;
+  uint64_t frames_dropped_;
+
+  volatile uint32_t stats_sequence_;
+  RefreshStatistics stats_;
 };
 
-RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays)
-  : frame_(new Framebuffer(rows, 32 * chained_displays)),
-    io_(NULL), updater_(NULL) {
+RGBMatrix::Options::Options()
+  : rows(32), chained_displays(1), parallel_chains(1),
+    bitplane_layout(kFullWordBitplanes), multiplexing(kDirectMultiplexing),
+    panel_arrangement(NULL),
+    bitplane_base_nanos(kDefaultBitplaneBaseNanos),
+    optimize_static_content(false), temporal_dithering(false) {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  refresh_cpu = (cpus > 1) ? cpus - 1 : -1;
+}
+
+RGBMatrix::RGBMatrix(OutputBackend *io, int rows, int chained_displays,
+                     int parallel_chains)
+  : mapper_(NULL), active_(NULL), io_(NULL),
+    refresh_cpu_(-1), refresh_cpu_pinned_(false), updater_(NULL) {
+  Options options;
+  options.rows = rows;
+  options.chained_displays = chained_displays;
+  options.parallel_chains = parallel_chains;
+  Init(io, options);
+}
+
+RGBMatrix::RGBMatrix(OutputBackend *io, const Options &options)
+  : mapper_(NULL), active_(NULL), io_(NULL),
+    refresh_cpu_(-1), refresh_cpu_pinned_(false), updater_(NULL) {
+  Init(io, options);
+}
+
+void RGBMatrix::Init(OutputBackend *io, const Options &options) {
+  options_ = options;
+  options_.panel_arrangement = NULL;  // Not ours to keep.
+  if (options.panel_arrangement) {
+    mapper_ = new PixelMapper();
+    const char *const spec = options.panel_arrangement;
+    const bool valid = (spec[0] == '@'
+                        ? mapper_->LoadFile(spec + 1, options.rows,
+                                            options.chained_displays,
+                                            options.parallel_chains)
+                        : mapper_->Parse(spec, options.rows,
+                                         options.chained_displays,
+                                         options.parallel_chains));
+    if (!valid) {
+      delete mapper_;  // Parse() told what is wrong.
+      mapper_ = NULL;
+    }
+  }
+  active_ = new FrameCanvas(CreateFramebuffer());
+  created_frames_.push_back(active_);
+  refresh_cpu_ = options.refresh_cpu;
   Clear();
   SetGPIO(io);
 }
 
 RGBMatrix::~RGBMatrix() {
-  updater_->Stop();
-  updater_->WaitStopped();
-  delete updater_;
+  if (updater_) {
+    updater_->Stop();
+    updater_->WaitStopped();
+    delete updater_;
+    if (refresh_cpu_pinned_) Thread::ReleaseCpu(refresh_cpu_);
+  }
+
+  if (io_) {
+    active_->framebuffer()->Clear();
+    active_->framebuffer()->DumpToMatrix(io_);
+  }
 
-  frame_->Clear();
-  frame_->DumpToMatrix(io_);
-  delete frame_;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    delete created_frames_[i];
+  }
+  delete mapper_;
 }
 
-void RGBMatrix::SetGPIO(GPIO *io) {
+void RGBMatrix::SetGPIO(OutputBackend *io) {
   if (io == NULL) return;  // nothing to set.
   if (io_ != NULL) return;  // already set.
   io_ = io;
-  Framebuffer::InitGPIO(io_);
-  updater_ = new UpdateThread(this);
-  updater_->Start(99);  // Whatever we get :)
+  active_->framebuffer()->InitGPIO(io_);
+  updater_ = new UpdateThread(io_, active_);
+  // Realtime priority only for the real hardware; other outputs don't
+  // sleep, so they would just hog the CPU.
+  const bool is_hardware = (dynamic_cast<GPIO*>(io_) != NULL);
+  const int priority = is_hardware ? 99 : 0;  // Whatever we get :)
+  updater_->Start(priority);
+  if (refresh_cpu_ >= 0 && refresh_cpu_ < 32
+      && updater_->SetAffinity(1 << refresh_cpu_)) {
+    Thread::ReserveCpu(refresh_cpu_);
+    refresh_cpu_pinned_ = true;
+  }
+}
+
+int RGBMatrix::refresh_cpu() const {
+  return refresh_cpu_pinned_ ? refresh_cpu_ : -1;
+}
+
+RGBMatrix::Framebuffer *RGBMatrix::CreateFramebuffer() const {
+  return new Framebuffer(options_.rows, 32 * options_.chained_displays,
+                         options_.parallel_chains, options_.multiplexing,
+                         mapper_, options_.bitplane_layout,
+                         options_.bitplane_base_nanos,
+                         options_.optimize_static_content,
+                         options_.temporal_dithering);
+}
+
+FrameCanvas *RGBMatrix::CreateFrameCanvas() {
+  MutexLock l(&frames_mutex_);  // The settings are taken over completely.
+  Framebuffer *const current = active_->framebuffer();
+  Framebuffer *const frame = CreateFramebuffer();
+  frame->SetPWMBits(current->pwmbits());
+  frame->set_luminance_correct(current->luminance_correct());
+  frame->SetBrightness(current->brightness());
+  frame->SetScanOffset(current->scan_offset());
+  frame->SetScanMirror(current->scan_mirror());
+  FrameCanvas *result = new FrameCanvas(frame);
+  created_frames_.push_back(result);
+  return result;
+}
+
+FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other) {
+  FrameCanvas *previous = active_;
+  if (updater_) {
+    previous = updater_->SwapOnVSync(other);
+  }
+  if (other) active_ = other;
+  return previous;
 }
 
-bool RGBMatrix::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
-uint8_t RGBMatrix::pwmbits() { return frame_->pwmbits(); }
+// PWM bits, luminance correction, brightness and the scan-out transformation
+// are applied to all frames, so that swapping buffers does not change the
+// look of the display.
+bool RGBMatrix::SetPWMBits(uint8_t value) {
+  MutexLock l(&frames_mutex_);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (!created_frames_[i]->framebuffer()->SetPWMBits(value))
+      return false;
+  }
+  return true;
+}
+uint8_t RGBMatrix::pwmbits() { return active_->framebuffer()->pwmbits(); }
 
 // Map brightness of output linearly to input with CIE1931 profile.
 void RGBMatrix::set_luminance_correct(bool on) {
-  frame_->set_luminance_correct(on);
+  MutexLock l(&frames_mutex_);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->set_luminance_correct(on);
+  }
+}
+bool RGBMatrix::luminance_correct() const {
+  return active_->framebuffer()->luminance_correct();
+}
+
+bool RGBMatrix::SetBrightness(uint8_t percent) {
+  MutexLock l(&frames_mutex_);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (!created_frames_[i]->framebuffer()->SetBrightness(percent))
+      return false;
+  }
+  return true;
+}
+uint8_t RGBMatrix::brightness() {
+  return active_->framebuffer()->brightness();
+}
+
+bool RGBMatrix::SetScanOffset(int column_offset) {
+  if (mapper_ != NULL || options_.multiplexing != kDirectMultiplexing)
+    return false;
+  MutexLock l(&frames_mutex_);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetScanOffset(column_offset);
+  }
+  return true;
+}
+int RGBMatrix::scan_offset() {
+  return active_->framebuffer()->scan_offset();
+}
+
+bool RGBMatrix::SetScanMirror(bool horizontal, bool vertical) {
+  if (mapper_ != NULL || options_.multiplexing != kDirectMultiplexing)
+    return false;
+  const uint8_t mirror = ((horizontal ? Framebuffer::kMirrorHorizontal : 0)
+                          | (vertical ? Framebuffer::kMirrorVertical : 0));
+  MutexLock l(&frames_mutex_);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetScanMirror(mirror);
+  }
+  return true;
+}
+
+bool RGBMatrix::GetRefreshStatistics(RefreshStatistics *stats) {
+  if (updater_ == NULL)
+    return false;
+  updater_->GetStatistics(stats);
+  return true;
+}
+
+bool RGBMatrix::GetBitplaneTiming(int plane, long *intended_nanos,
+                                  long *mean_error_nanos) {
+  if (plane < 0 || plane >= kBitPlanes)
+    return false;
+  RefreshStatistics stats;
+  if (!GetRefreshStatistics(&stats) || stats.bitplane_count[plane] == 0)
+    return false;
+  *intended_nanos = active_->framebuffer()->bitplane_nanos(plane);
+  *mean_error_nanos = (stats.bitplane_error_nanos[plane]
+                       / (int64_t) stats.bitplane_count[plane]);
+  return true;
+}
+
+BitplaneImage *RGBMatrix::CreateBitplaneImage(int width) {
+  if (mapper_ != NULL || options_.multiplexing != kDirectMultiplexing
+      || width <= 0) {
+    return NULL;
+  }
+  Framebuffer *const current = active_->framebuffer();
+  Framebuffer *const frame
+    = new Framebuffer(options_.rows, width, options_.parallel_chains,
+                      kDirectMultiplexing, NULL, options_.bitplane_layout,
+                      options_.bitplane_base_nanos,
+                      options_.optimize_static_content,
+                      options_.temporal_dithering);
+  frame->SetPWMBits(current->pwmbits());
+  frame->set_luminance_correct(current->luminance_correct());
+  return new BitplaneImage(frame);
 }
-bool RGBMatrix::luminance_correct() const { return frame_->luminance_correct(); }
-void RGBMatrix::UpdateScreen() { frame_->DumpToMatrix(io_); }
 
-// -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
-int RGBMatrix::width() const { return frame_->width(); }
-int RGBMatrix::height() const { return frame_->height(); }
+bool RGBMatrix::CopyColumns(const BitplaneImage *image, int image_x, int x,
+                            int width) {
+  return active_->CopyColumns(image, image_x, x, width);
+}
+
+// -- Implementation of RGBMatrix Canvas: delegation to the active FrameCanvas
+int RGBMatrix::width() const { return active_->width(); }
+int RGBMatrix::height() const { return active_->height(); }
 void RGBMatrix::SetPixel(int x, int y,
                          uint8_t red, uint8_t green, uint8_t blue) {
-  frame_->SetPixel(x, y, red, green, blue);
+  active_->framebuffer()->SetPixel(x, y, red, green, blue);
 }
-void RGBMatrix::Clear() { return frame_->Clear(); }
+void RGBMatrix::Clear() { return active_->framebuffer()->Clear(); }
 void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  active_->framebuffer()->Fill(red, green, blue);
+}
+void RGBMatrix::SetPixels(int x, int y, int width, int height,
+                          const uint8_t *rgb_data, int stride) {
+  active_->framebuffer()->SetPixels(x, y, width, height, rgb_data, stride);
+}
+void RGBMatrix::SetBitmap(int x, int y, int width, int height,
+                          const uint32_t *rows,
+                          const uint8_t *foreground,
+                          const uint8_t *background) {
+  active_->framebuffer()->SetBitmap(x, y, width, height, rows,
+                                    foreground, background);
+}
+
+// -- Implementation of FrameCanvas: delegation to the Framebuffer
+FrameCanvas::~FrameCanvas() { delete frame_; }
+bool FrameCanvas::SetPWMBits(uint8_t value) {
+  return frame_->SetPWMBits(value);
+}
+uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
+bool FrameCanvas::HasChanges() const { return frame_->HasChanges(); }
+void FrameCanvas::DumpToMatrix(OutputBackend *output) {
+  frame_->DumpToMatrix(output);
+}
+bool FrameCanvas::CopyColumns(const BitplaneImage *image, int image_x, int x,
+                              int width) {
+  return frame_->CopyColumns(*image->frame_, image_x, x, width);
+}
+
+int FrameCanvas::width() const { return frame_->width(); }
+int FrameCanvas::height() const { return frame_->height(); }
+void FrameCanvas::SetPixel(int x, int y,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::Clear() { return frame_->Clear(); }
+void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb_data, int stride) {
+  frame_->SetPixels(x, y, width, height, rgb_data, stride);
+}
+void FrameCanvas::SetBitmap(int x, int y, int width, int height,
+                            const uint32_t *rows,
+                            const uint8_t *foreground,
+                            const uint8_t *background) {
+  frame_->SetBitmap(x, y, width, height, rows, foreground, background);
+}
+
+// -- Implementation of BitplaneImage: delegation to the Framebuffer
+BitplaneImage::~BitplaneImage() { delete frame_; }
+int BitplaneImage::width() const { return frame_->width(); }
+int BitplaneImage::height() const { return frame_->height(); }
+void BitplaneImage::SetPixel(int x, int y,
+                             uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetPixel(x, y, red, green, blue);
+}
+void BitplaneImage::Clear() { return frame_->Clear(); }
+void BitplaneImage::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->Fill(red, green, blue);
+}
+void BitplaneImage::SetPixels(int x, int y, int width, int height,
+                              const uint8_t *rgb_data, int stride) {
+  frame_->SetPixels(x, y, width, height, rgb_data, stride);
+}
+void BitplaneImage::SetBitmap(int x, int y, int width, int height,
+                              const uint32_t *rows,
+                              const uint8_t *foreground,
+                              const uint8_t *background) {
+  frame_->SetBitmap(x, y, width, height, rows, foreground, background);
+}
 }  // end namespace rgb_matrix
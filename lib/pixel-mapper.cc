@@ -0,0 +1,229 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "pixel-mapper.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+namespace rgb_matrix {
+namespace {
+enum {
+  kPanelColumns = 32,
+  kMaxGridSize = 256   // Panels in each direction; keeps the table sane.
+};
+
+// One panel: where it is on the wall and how it is mounted.
+struct Placement {
+  int column;
+  int row;
+  int rotation;  // Clockwise, in degrees.
+  bool mirror;
+};
+
+// Split "spec" into tokens, skipping comments.
+static void Tokenize(const char *spec, std::vector<std::string> *tokens) {
+  std::string token;
+  for (const char *p = spec; /**/; ++p) {
+    if (*p == '#') {
+      while (*p && *p != '\n') ++p;
+    }
+    if (*p == '\0' || *p == ';' || isspace(*p)) {
+      if (!token.empty()) tokens->push_back(token);
+      token.clear();
+      if (*p == '\0') break;
+    } else {
+      token += *p;
+    }
+  }
+}
+
+// Parse "<columns>x<rows>"
+static bool ParseGridSize(const std::string &token, int *columns, int *rows) {
+  char trailing;
+  return (sscanf(token.c_str(), "%dx%d%c", columns, rows, &trailing) == 2
+          && *columns > 0 && *columns <= kMaxGridSize
+          && *rows > 0 && *rows <= kMaxGridSize);
+}
+
+// Parse "[M][R<degrees>]"; at least one of them.
+static bool ParseTransform(const char *transform, Placement *panel) {
+  if (*transform == 'M') {
+    panel->mirror = true;
+    ++transform;
+    if (*transform == '\0') return true;
+  }
+  if (*transform != 'R') return false;
+  ++transform;
+  if (strcmp(transform, "0") == 0)   panel->rotation = 0;
+  else if (strcmp(transform, "90") == 0)  panel->rotation = 90;
+  else if (strcmp(transform, "180") == 0) panel->rotation = 180;
+  else if (strcmp(transform, "270") == 0) panel->rotation = 270;
+  else return false;
+  return true;
+}
+
+// Parse "<column>,<row>[:<transform>]"
+static bool ParsePlacement(const std::string &token, Placement *panel) {
+  int consumed = 0;
+  if (sscanf(token.c_str(), "%d,%d%n",
+             &panel->column, &panel->row, &consumed) != 2
+      || panel->column < 0 || panel->column >= kMaxGridSize
+      || panel->row < 0 || panel->row >= kMaxGridSize) {
+    return false;
+  }
+  panel->rotation = 0;
+  panel->mirror = false;
+  const char *rest = token.c_str() + consumed;
+  if (*rest == '\0') return true;
+  return *rest == ':' && ParseTransform(rest + 1, panel);
+}
+}  // anonymous namespace
+
+const uint32_t PixelMapper::kNoPanel;
+
+PixelMapper::PixelMapper() : width_(0), height_(0) {}
+
+bool PixelMapper::Parse(const char *spec,
+                        int rows, int chained_displays, int parallel_chains) {
+  std::vector<std::string> tokens;
+  Tokenize(spec, &tokens);
+
+  std::vector<Placement> panels;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const std::string &token = tokens[i];
+    if (token == "serpentine" || token == "rows") {
+      int grid_columns, grid_rows;
+      if (i + 1 >= tokens.size()
+          || !ParseGridSize(tokens[i + 1], &grid_columns, &grid_rows)) {
+        fprintf(stderr, "Panel arrangement: expected <columns>x<rows> "
+                "after '%s'\n", token.c_str());
+        return false;
+      }
+      ++i;
+      for (int row = 0; row < grid_rows; ++row) {
+        // Every other row of a serpentine goes back, upside down.
+        const bool back = (token == "serpentine" && row % 2 == 1);
+        for (int col = 0; col < grid_columns; ++col) {
+          Placement panel;
+          panel.column = back ? grid_columns - 1 - col : col;
+          panel.row = row;
+          panel.rotation = back ? 180 : 0;
+          panel.mirror = false;
+          panels.push_back(panel);
+        }
+      }
+    } else {
+      Placement panel;
+      if (!ParsePlacement(token, &panel)) {
+        fprintf(stderr, "Panel arrangement: can't parse '%s'; expected "
+                "<column>,<row>[:<transform>]\n", token.c_str());
+        return false;
+      }
+      if ((panel.rotation == 90 || panel.rotation == 270)
+          && rows != kPanelColumns) {
+        fprintf(stderr, "Panel arrangement: '%s': rotation by %d degrees "
+                "needs square panels\n", token.c_str(), panel.rotation);
+        return false;
+      }
+      panels.push_back(panel);
+    }
+  }
+
+  if (panels.empty()) {
+    fprintf(stderr, "Panel arrangement: no panels\n");
+    return false;
+  }
+  const int connected = chained_displays * parallel_chains;
+  if ((int) panels.size() > connected) {
+    fprintf(stderr, "Panel arrangement: %d panels, but only %d are "
+            "connected\n", (int) panels.size(), connected);
+    return false;
+  }
+
+  int width = 0, height = 0;
+  for (size_t i = 0; i < panels.size(); ++i) {
+    width = std::max(width, (panels[i].column + 1) * kPanelColumns);
+    height = std::max(height, (panels[i].row + 1) * rows);
+  }
+
+  std::vector<uint32_t> table(width * height, kNoPanel);
+  for (size_t i = 0; i < panels.size(); ++i) {
+    const Placement &panel = panels[i];
+    const int matrix_x0 = (i % chained_displays) * kPanelColumns;
+    const int matrix_y0 = (i / chained_displays) * rows;
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < kPanelColumns; ++x) {
+        const int mx = panel.mirror ? kPanelColumns - 1 - x : x;
+        int wall_x, wall_y;  // Within the panel's place on the wall.
+        switch (panel.rotation) {
+        case 90:
+          wall_x = rows - 1 - y;
+          wall_y = mx;
+          break;
+        case 180:
+          wall_x = kPanelColumns - 1 - mx;
+          wall_y = rows - 1 - y;
+          break;
+        case 270:
+          wall_x = y;
+          wall_y = kPanelColumns - 1 - mx;
+          break;
+        default:
+          wall_x = mx;
+          wall_y = y;
+        }
+        uint32_t &entry = table[(panel.row * rows + wall_y) * width
+                                + panel.column * kPanelColumns + wall_x];
+        if (entry != kNoPanel) {
+          fprintf(stderr, "Panel arrangement: more than one panel at %d,%d\n",
+                  panel.column, panel.row);
+          return false;
+        }
+        entry = (matrix_y0 + y) << 16 | (matrix_x0 + x);
+      }
+    }
+  }
+
+  width_ = width;
+  height_ = height;
+  table_.swap(table);
+  return true;
+}
+
+bool PixelMapper::LoadFile(const char *path,
+                           int rows, int chained_displays,
+                           int parallel_chains) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Panel arrangement: can't open %s: %s\n",
+            path, strerror(errno));
+    return false;
+  }
+  std::string spec;
+  char buffer[1024];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    spec.append(buffer, len);
+  }
+  fclose(f);
+  return Parse(spec.c_str(), rows, chained_displays, parallel_chains);
+}
+}  // namespace rgb_matrix
@@ -0,0 +1,183 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "simulated-gpio.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "framebuffer-internal.h"
+
+namespace rgb_matrix {
+namespace {
+// The bits we look at; same as what the framebuffer writes.
+struct SimulatedBits {
+  SimulatedBits() {
+    IoBits b;
+    b.bits.clock_rev1 = b.bits.clock_rev2 = 1;
+    clock = b.raw;
+
+    b.raw = 0;
+    b.bits.output_enable_rev1 = b.bits.output_enable_rev2 = 1;
+    output_enable = b.raw;
+
+    b.raw = 0;
+    b.bits.strobe = 1;
+    strobe = b.raw;
+
+    for (int chain = 0; chain < kMaxParallelChains; ++chain) {
+      GetChainColorBits(chain, color[chain]);
+    }
+  }
+
+  uint32_t clock;
+  uint32_t output_enable;   // Negative logic: lit while these are low.
+  uint32_t strobe;
+  uint32_t color[kMaxParallelChains][6];  // r1, g1, b1, r2, g2, b2
+};
+
+static const SimulatedBits kBits;
+
+// Bits per chain in shift_register_ and latch_.
+static const uint32_t kColorsPerChain = 6;
+}  // anonymous namespace
+
+SimulatedGPIO::SimulatedGPIO(int rows, int columns, int history_size,
+                             int parallel_chains)
+  : rows_(rows), columns_(columns), double_rows_(rows / 2),
+    parallel_(parallel_chains),
+    outputs_(0), state_(kBits.output_enable),
+    shift_register_(new uint32_t[columns]), shift_pos_(0),
+    latch_(new uint32_t[columns]),
+    on_time_(new uint64_t[rows * parallel_chains * columns * 3]),
+    elapsed_nanos_(0),
+    history_(new Operation[history_size]), history_capacity_(history_size),
+    write_count_(0), recorded_count_(0) {
+  assert(history_size > 0);
+  assert(parallel_ >= 1 && parallel_ <= kMaxParallelChains);
+  memset(shift_register_, 0, columns_ * sizeof(*shift_register_));
+  memset(latch_, 0, columns_ * sizeof(*latch_));
+  ResetImage();
+}
+
+SimulatedGPIO::~SimulatedGPIO() {
+  delete [] shift_register_;
+  delete [] latch_;
+  delete [] on_time_;
+  delete [] history_;
+}
+
+uint32_t SimulatedGPIO::InitOutputs(uint32_t outputs) {
+  outputs &= GPIO::kValidBits;   // Behave like the real thing.
+  outputs_ = outputs;
+  return outputs_;
+}
+
+void SimulatedGPIO::SetBits(uint32_t value) {
+  Record(Operation::kSetBits, value);
+  ++write_count_;
+  const uint32_t rising = value & ~state_;
+  state_ |= value;
+  if (rising & kBits.clock) ClockIn();
+  if (rising & kBits.strobe) Latch();
+}
+
+void SimulatedGPIO::ClearBits(uint32_t value) {
+  Record(Operation::kClearBits, value);
+  ++write_count_;
+  state_ &= ~value;
+}
+
+long SimulatedGPIO::SleepNanos(long nanos) {
+  Record(Operation::kSleep, nanos);
+  elapsed_nanos_ += nanos;
+  if ((state_ & kBits.output_enable) != 0)
+    return nanos;  // Output disabled: dark.
+
+  IoBits address;
+  address.raw = state_;
+  const int d_row = address.bits.row % double_rows_;
+  for (int chain = 0; chain < parallel_; ++chain) {
+    uint64_t *upper = &on_time_[(chain * rows_ + d_row) * columns_ * 3];
+    uint64_t *lower = upper + double_rows_ * columns_ * 3;
+    for (int x = 0; x < columns_; ++x) {
+      const uint32_t lit = latch_[x] >> (chain * kColorsPerChain);
+      for (int c = 0; c < 3; ++c) {
+        if (lit & (1 << c)) upper[3 * x + c] += nanos;
+        if (lit & (1 << (c + 3))) lower[3 * x + c] += nanos;
+      }
+    }
+  }
+  return nanos;
+}
+
+void SimulatedGPIO::ClockIn() {
+  uint32_t value = 0;
+  for (int chain = 0; chain < parallel_; ++chain) {
+    for (int i = 0; i < 6; ++i) {
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+      const bool on = (state_ & kBits.color[chain][i]) == 0;
+#else
+      const bool on = (state_ & kBits.color[chain][i]) != 0;
+#endif
+      if (on) value |= 1 << (chain * kColorsPerChain + i);
+    }
+  }
+  shift_register_[shift_pos_] = value;
+  shift_pos_ = (shift_pos_ + 1) % columns_;
+}
+
+void SimulatedGPIO::Latch() {
+  // The first column clocked in (of the last "columns_") is the first on
+  // the chain.
+  for (int x = 0; x < columns_; ++x) {
+    latch_[x] = shift_register_[(shift_pos_ + x) % columns_];
+  }
+}
+
+void SimulatedGPIO::GetOnTime(int x, int y,
+                              uint64_t *red, uint64_t *green,
+                              uint64_t *blue) const {
+  assert(x >= 0 && x < columns_ && y >= 0 && y < rows_ * parallel_);
+  const uint64_t *pixel = &on_time_[(y * columns_ + x) * 3];
+  *red = pixel[0];
+  *green = pixel[1];
+  *blue = pixel[2];
+}
+
+void SimulatedGPIO::ResetImage() {
+  memset(on_time_, 0,
+         rows_ * parallel_ * columns_ * 3 * sizeof(*on_time_));
+}
+
+void SimulatedGPIO::Record(Operation::Type type, uint32_t value) {
+  Operation &op = history_[recorded_count_ % history_capacity_];
+  op.type = type;
+  op.value = value;
+  ++recorded_count_;
+}
+
+int SimulatedGPIO::history_size() const {
+  return (recorded_count_ < (uint64_t) history_capacity_
+          ? (int) recorded_count_
+          : history_capacity_);
+}
+
+const SimulatedGPIO::Operation &SimulatedGPIO::history(int index) const {
+  assert(index >= 0 && index < history_size());
+  const uint64_t oldest = recorded_count_ - history_size();
+  return history_[(oldest + index) % history_capacity_];
+}
+}  // namespace rgb_matrix
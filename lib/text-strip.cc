@@ -0,0 +1,158 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "graphics.h"
+#include "utf8-internal.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+// The canvas the font draws the glyphs on: sets the bits in the strip.
+class TextStrip::Renderer : public Canvas {
+public:
+  explicit Renderer(TextStrip *strip) : strip_(strip) {}
+
+  virtual int width() const { return strip_->width_; }
+  virtual int height() const { return strip_->height_; }
+
+  virtual void SetPixel(int x, int y, uint8_t, uint8_t, uint8_t) {
+    const uint32_t bit = 0x80000000;
+    SetBitmap(x, y, 1, 1, &bit, NULL, NULL);
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t, uint8_t, uint8_t) {}
+
+  // Only the set bits matter; there is no color in the strip.
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         const uint8_t *, const uint8_t *) {
+    if (x < 0 || width <= 0) return;
+    strip_->Grow(x + width);
+    const uint32_t in_width = (width >= 32) ? ~0u : ~(~0u >> width);
+    const int column = strip_->first_ + x;
+    const int shift = column % 32;
+    std::deque<uint32_t>::iterator chunk
+      = strip_->bits_.begin() + (column / 32) * strip_->height_;
+    for (int row = std::max(0, y);
+         row < std::min(strip_->height_, y + height); ++row) {
+      const uint32_t bits = rows[row - y] & in_width;
+      chunk[row] |= bits >> shift;
+      if (shift > 0 && (bits << (32 - shift)) != 0)
+        chunk[strip_->height_ + row] |= bits << (32 - shift);
+    }
+  }
+
+private:
+  TextStrip *const strip_;
+};
+
+TextStrip::TextStrip(const Font &font)
+  : first_(0), font_(font), height_(std::max(0, font.height())), width_(0) {}
+
+void TextStrip::Append(const char *utf8_text) {
+  Append(utf8_text, strlen(utf8_text));
+}
+
+void TextStrip::Append(const char *utf8_text, size_t len) {
+  pending_.append(utf8_text, len);
+  const char *it = pending_.data();
+  const char *const end = it + pending_.size()
+    - utf8_incomplete_tail(it, it + pending_.size());
+  Renderer renderer(this);
+  const Color color(255, 255, 255);  // Doesn't matter.
+  uint32_t codepoints[64];
+  while (it < end) {
+    const int count = utf8_decode(it, end, codepoints, 64);
+    width_ += font_.DrawGlyphs(&renderer, width_, font_.baseline(), color,
+                               NULL, codepoints, count);
+  }
+  pending_.erase(0, it - pending_.data());  // The rest comes next time.
+  Grow(width_);
+}
+
+void TextStrip::AppendSpace(int pixels) {
+  if (pixels <= 0) return;
+  width_ += pixels;
+  Grow(width_);
+}
+
+void TextStrip::Grow(int columns) {
+  const size_t chunks = (first_ + columns + 31) / 32;
+  if (bits_.size() < chunks * height_)
+    bits_.resize(chunks * height_, 0);
+}
+
+void TextStrip::Discard(int columns) {
+  columns = std::min(std::max(columns, 0), width_);
+  width_ -= columns;
+  first_ += columns;
+  const int chunks = first_ / 32;
+  bits_.erase(bits_.begin(),
+              bits_.begin() + std::min(chunks * height_, (int)bits_.size()));
+  first_ %= 32;
+}
+
+uint32_t TextStrip::Columns(int column, int row) const {
+  if (column >= width_ || column <= -32)
+    return 0;
+  // Bit position in the chunks; floor division, as it can be negative.
+  const int bit = first_ + column;
+  const int chunk = (bit >= 0) ? bit / 32 : (bit - 31) / 32;
+  const int shift = bit - 32 * chunk;
+  const int chunk_count = bits_.size() / height_;
+  uint32_t result = 0;
+  if (chunk >= 0 && chunk < chunk_count)
+    result = bits_[chunk * height_ + row] << shift;
+  if (shift > 0 && chunk + 1 < chunk_count)
+    result |= bits_[(chunk + 1) * height_ + row] >> (32 - shift);
+  if (column < 0)
+    result &= ~0u >> -column;        // Before the strip.
+  if (width_ - column < 32)
+    result &= ~(~0u >> (width_ - column));  // After the end.
+  return result;
+}
+
+void TextStrip::Draw(Canvas *c, int x, int y, int offset, const Color &color,
+                     const Color *background_color) const {
+  if (x < 0) {  // Start with what is visible.
+    offset -= x;
+    x = 0;
+  }
+  const uint8_t foreground[3] = { color.r, color.g, color.b };
+  uint8_t background[3] = { 0, 0, 0 };
+  if (background_color) {
+    background[0] = background_color->r;
+    background[1] = background_color->g;
+    background[2] = background_color->b;
+  }
+  const int top = y - font_.baseline();
+  uint32_t rows[256];
+  for (int y0 = 0; y0 < height_; y0 += 256) {  // Fonts are rarely that high.
+    const int count = std::min(256, height_ - y0);
+    for (int column = x; column < c->width(); column += 32) {
+      const int strip_column = offset + (column - x);
+      if (background_color == NULL && strip_column >= width_)
+        break;  // Nothing more to draw.
+      for (int row = 0; row < count; ++row)
+        rows[row] = Columns(strip_column, y0 + row);
+      c->SetBitmap(column, top + y0, std::min(32, c->width() - column),
+                   count, rows, foreground,
+                   background_color ? background : NULL);
+    }
+  }
+}
+}  // namespace rgb_matrix
@@ -15,9 +15,12 @@
 
 #include "thread.h"
 
+#include <errno.h>
 #include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <assert.h>
 
 namespace rgb_matrix {
@@ -40,17 +43,102 @@ void Thread::WaitStopped() {
   started_ = false;
 }
 
-void Thread::Start(int priority) {
+bool Thread::Start(int priority, uint32_t affinity_mask) {
   assert(!started_);
   pthread_create(&thread_, NULL, &PthreadCallRun, this);
+  started_ = true;
 
+  bool success = true;
   if (priority > 0) {
     struct sched_param p;
     p.sched_priority = priority;
-    pthread_setschedparam(thread_, SCHED_FIFO, &p);
+    const int err = pthread_setschedparam(thread_, SCHED_FIFO, &p);
+    if (err != 0) {
+      fprintf(stderr, "Can't set realtime priority %d: %s\n",
+              priority, strerror(err));
+      success = false;
+    }
   }
 
-  started_ = true;
+  if (affinity_mask != 0 && !SetAffinity(affinity_mask)) {
+    success = false;
+  }
+
+  return success;
+}
+
+bool Thread::SetAffinity(uint32_t affinity_mask) {
+  assert(started_);
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu = 0; cpu < 32; ++cpu) {
+    if (affinity_mask & (1 << cpu)) CPU_SET(cpu, &cpu_set);
+  }
+  const int err = pthread_setaffinity_np(thread_, sizeof(cpu_set), &cpu_set);
+  if (err != 0) {
+    fprintf(stderr, "Can't set CPU affinity 0x%x: %s\n",
+            affinity_mask, strerror(err));
+    return false;
+  }
+  return true;
+}
+
+/*static*/ uint32_t Thread::reserved_cpus_ = 0;
+
+/*static*/ void Thread::ReserveCpu(int cpu) {
+  if (cpu >= 0 && cpu < 32) __atomic_fetch_or(&reserved_cpus_, 1 << cpu,
+                                              __ATOMIC_RELAXED);
+}
+
+/*static*/ void Thread::ReleaseCpu(int cpu) {
+  if (cpu >= 0 && cpu < 32) __atomic_fetch_and(&reserved_cpus_, ~(1 << cpu),
+                                               __ATOMIC_RELAXED);
+}
+
+/*static*/ uint32_t Thread::UnreservedCpus() {
+  const long online = sysconf(_SC_NPROCESSORS_ONLN);
+  const uint32_t all = (online >= 32 || online < 1)
+    ? 0xffffffff : (1u << online) - 1;
+  const uint32_t result = all & ~__atomic_load_n(&reserved_cpus_,
+                                                 __ATOMIC_RELAXED);
+  return result ? result : all;
+}
+
+StopRequest::StopRequest() : stopped_(false) {
+  // Deadlines on the monotonic clock, so that setting the time does not
+  // change how long we sleep.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wakeup_, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+StopRequest::~StopRequest() {
+  pthread_cond_destroy(&wakeup_);
+}
+
+void StopRequest::Stop() {
+  MutexLock l(&mutex_);
+  __atomic_store_n(&stopped_, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&wakeup_);
+}
+
+bool StopRequest::SleepMillis(long milliseconds) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += milliseconds / 1000;
+  deadline.tv_nsec += (milliseconds % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000;
+  }
+  MutexLock l(&mutex_);
+  while (!stopped()) {
+    if (mutex_.WaitOn(&wakeup_, deadline) == ETIMEDOUT)
+      break;
+  }
+  return !stopped();
 }
 
 }  // namespace rgb_matrix
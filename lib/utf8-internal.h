@@ -16,42 +16,99 @@
 #define RPI_GRAPHICS_UTF8_H
 
 #include <stdint.h>
+#include <string.h>
 
-// Utility function that reads UTF-8 encoded codepoints from byte iterator.
-// No error checking, we assume string is UTF-8 clean.
-template <typename byte_iterator>
-uint32_t utf8_next_codepoint(byte_iterator &it) {
-  uint32_t cp = *it++;
-  if (cp < 0x80) {
-    return cp;   // iterator already incremented.
-  }
-  else if ((cp & 0xE0) == 0xC0) {
-    cp = ((cp & 0x1F) << 6) + (*it & 0x3F);
-  }
-  else if ((cp & 0xF0) == 0xE0) {
-    cp = ((cp & 0x0F) << 12) + ((*it & 0x3F) << 6);
-    cp += (*++it & 0x3F);
+// Decoding of UTF-8 text in [it, end). Malformed input never reads beyond
+// "end": invalid bytes, overlong encodings, surrogates, codepoints beyond
+// U+10FFFF and sequences cut off at "end" are decoded as the replacement
+// character U+FFFD, consuming the bytes up to the first one that does not
+// fit (as recommended by the Unicode standard).
+
+static const uint32_t kUtf8Replacement = 0xFFFD;
+
+// Decode the character at "it" and advance "it" past it. "it" < "end".
+static inline uint32_t utf8_next_codepoint(const char *&it, const char *end) {
+  const uint8_t lead = *it++;
+  if (lead < 0x80)
+    return lead;
+  int trailing;
+  uint32_t cp;
+  uint8_t low = 0x80, high = 0xBF;  // Range of the next byte.
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    trailing = 1;
+    cp = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    trailing = 2;
+    cp = lead & 0x0F;
+    if (lead == 0xE0) low = 0xA0;        // Overlong.
+    else if (lead == 0xED) high = 0x9F;  // Surrogates.
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    trailing = 3;
+    cp = lead & 0x07;
+    if (lead == 0xF0) low = 0x90;        // Overlong.
+    else if (lead == 0xF4) high = 0x8F;  // Beyond U+10FFFF.
+  } else {
+    return kUtf8Replacement;
   }
-  else if ((cp & 0xF8) == 0xF0) {
-    cp = ((cp & 0x07) << 18) + ((*it & 0x3F) << 12);
-    cp += (*++it & 0x3F) << 6;
-    cp += (*++it & 0x3F);
+  for (/**/; trailing > 0; --trailing) {
+    if (it == end)
+      return kUtf8Replacement;
+    const uint8_t byte = *it;
+    if (byte < low || byte > high)
+      return kUtf8Replacement;
+    cp = (cp << 6) | (byte & 0x3F);
+    ++it;
+    low = 0x80;
+    high = 0xBF;
   }
-  else if ((cp & 0xFC) == 0xF8) {
-    cp = ((cp & 0x03) << 24) + ((*it & 0x3F) << 18);
-    cp += (*++it & 0x3F) << 12;
-    cp += (*++it & 0x3F) << 6;
-    cp += (*++it & 0x3F);
+  return cp;
+}
+
+// Decode up to "max" characters into "codepoints", advancing "it". Runs of
+// ASCII are taken 8 bytes at a time. Returns the number of characters.
+static inline int utf8_decode(const char *&it, const char *end,
+                              uint32_t *codepoints, int max) {
+  int count = 0;
+  while (count < max && it < end) {
+    // Text in other scripts would mostly fail the look for 8 ASCII bytes;
+    // only start one at an ASCII byte.
+    if ((uint8_t) *it >= 0x80) {
+      codepoints[count++] = utf8_next_codepoint(it, end);
+      continue;
+    }
+    while (max - count >= 8 && end - it >= 8) {
+      uint64_t bytes;
+      memcpy(&bytes, it, sizeof(bytes));
+      if (bytes & 0x8080808080808080ULL)
+        break;  // Not all ASCII.
+      for (int i = 0; i < 8; ++i)
+        codepoints[count + i] = (uint8_t) it[i];
+      count += 8;
+      it += 8;
+    }
+    if (count < max && it < end)
+      codepoints[count++] = utf8_next_codepoint(it, end);
   }
-  else if ((cp & 0xFE) == 0xFC) {
-    cp = ((cp & 0x01) << 30) + ((*it & 0x3F) << 24);
-    cp += (*++it & 0x3F) << 18;
-    cp += (*++it & 0x3F) << 12;
-    cp += (*++it & 0x3F) << 6;
-    cp += (*++it & 0x3F);
+  return count;
+}
+
+// Number of bytes at the end of [begin, end) that start a valid character,
+// but are not complete yet, e.g. when the text is read in blocks.
+static inline int utf8_incomplete_tail(const char *begin, const char *end) {
+  for (int back = 1; back <= 3 && back <= end - begin; ++back) {
+    const uint8_t byte = end[-back];
+    if (byte < 0x80 || (byte >= 0xC0 && byte < 0xC2) || byte > 0xF4)
+      return 0;
+    if (byte >= 0xC2) {  // Lead byte.
+      const int length = (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : 2;
+      if (length <= back)
+        return 0;
+      const char *it = end - back;
+      utf8_next_codepoint(it, end);
+      return (it == end) ? back : 0;  // Otherwise, it is invalid anyway.
+    }
   }
-  ++it;
-  return cp;
+  return 0;
 }
 
 #endif  // RPI_GRAPHICS_UTF8_H
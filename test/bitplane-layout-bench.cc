@@ -0,0 +1,109 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Memory per frame and refreshes per second with kFullWordBitplanes and
+// kPackedBitplanes, for a few chain lengths, showing random pixels.
+// The refreshes go to a SimulatedGPIO, which decodes every write, and to
+// an output that just takes the writes, which is closer to the cost of
+// the refresh itself.
+
+#include "led-matrix.h"
+#include "simulated-gpio.h"
+#include "test-util.h"
+
+#include <malloc.h>
+#include <stdio.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+// Takes the writes, doesn't sleep.
+class DiscardingOutput : public OutputBackend {
+public:
+  DiscardingOutput() : bits_(0) {}
+  virtual uint32_t InitOutputs(uint32_t outputs) { return outputs; }
+  virtual void SetBits(uint32_t value) { bits_ |= value; }
+  virtual void ClearBits(uint32_t value) { bits_ &= ~value; }
+  virtual long SleepNanos(long nanos) { return nanos; }
+
+private:
+  volatile uint32_t bits_;
+};
+
+// mallinfo2() is new in glibc 2.33; before, mallinfo() has the same in
+// ints, which is plenty for a frame.
+#if defined(__GLIBC_PREREQ)
+#  if __GLIBC_PREREQ(2, 33)
+#    define HAVE_MALLINFO2
+#  endif
+#endif
+
+static size_t AllocatedBytes() {
+#ifdef HAVE_MALLINFO2
+  const struct mallinfo2 info = mallinfo2();
+#else
+  const struct mallinfo info = mallinfo();
+#endif
+  return (size_t) info.uordblks + info.hblkhd;
+}
+
+static double RefreshesPerSecond(FrameCanvas *frame, OutputBackend *out) {
+  int refreshes = 0;
+  const double start = GetTimeSeconds();
+  double now;
+  do {
+    for (int i = 0; i < 5; ++i, ++refreshes) frame->DumpToMatrix(out);
+    now = GetTimeSeconds();
+  } while (now - start < 0.5);
+  return refreshes / (now - start);
+}
+
+int main() {
+  static const int kChains[] = { 1, 6, 12 };
+  printf("%-6s %-8s %-7s %12s %14s %14s\n", "chain", "parallel", "layout",
+         "bytes/frame", "Hz simulated", "Hz writes only");
+  for (int c = 0; c < 3; ++c) {
+    for (int parallel = 1; parallel <= 3; parallel += 2) {
+      for (int packed = 0; packed < 2; ++packed) {
+        RGBMatrix::Options options;
+        options.chained_displays = kChains[c];
+        options.parallel_chains = parallel;
+        options.bitplane_layout = (packed ? RGBMatrix::kPackedBitplanes
+                                   : RGBMatrix::kFullWordBitplanes);
+        RGBMatrix matrix(NULL, options);   // No refresh thread.
+
+        const size_t before = AllocatedBytes();
+        FrameCanvas *frame = matrix.CreateFrameCanvas();
+        const size_t bytes = AllocatedBytes() - before;
+
+        const int width = frame->width(), height = frame->height();
+        std::vector<uint8_t> pixels(3 * width * height);
+        TestRandom random(c);
+        random.Fill(&pixels[0], pixels.size());
+        frame->SetPixels(0, 0, width, height, &pixels[0], 3 * width);
+
+        SimulatedGPIO simulated(options.rows, width, 16, parallel);
+        DiscardingOutput discarding;
+        const double simulated_hz = RefreshesPerSecond(frame, &simulated);
+        const double discarding_hz = RefreshesPerSecond(frame, &discarding);
+        printf("%-6d %-8d %-7s %12zu %14.0f %14.0f\n", kChains[c], parallel,
+               packed ? "packed" : "full", bytes, simulated_hz,
+               discarding_hz);
+      }
+    }
+  }
+  return 0;
+}
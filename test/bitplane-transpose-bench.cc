@@ -0,0 +1,75 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Pixels per second converted to all 11 bitplanes by MapToBitplanes() and
+// by the scalar reference, for a double-row of a chain of six panels.
+
+#include "bitplane-transpose-internal.h"
+#include "test-util.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+static const int kPlanes = 11;
+static const int kWidth = 6 * 32;
+static const int kRounds = 20000;
+
+typedef void (*MapFunction32)(const ColorBitLayout &, const uint16_t *,
+                              const uint8_t *, const uint8_t *, int, int, int,
+                              uint32_t *, int);
+typedef void (*MapFunction8)(const ColorBitLayout &, const uint16_t *,
+                             const uint8_t *, const uint8_t *, int, int, int,
+                             uint8_t *, int);
+
+// Returns pixels per second; each column is two pixels, upper and lower.
+template <typename Word, typename Function>
+static double Measure(Function map, const ColorBitLayout &layout,
+                      const uint16_t *lut, const std::vector<uint8_t> &rgb) {
+  std::vector<Word> out(kPlanes * kWidth);
+  const double start = GetTimeSeconds();
+  for (int i = 0; i < kRounds; ++i) {
+    map(layout, lut, &rgb[0], &rgb[3 * kWidth], kWidth, 0, kPlanes,
+        &out[0], kWidth);
+  }
+  return 2.0 * kWidth * kRounds / (GetTimeSeconds() - start);
+}
+
+int main() {
+  TestRandom random(1);
+  std::vector<uint8_t> rgb(2 * 3 * kWidth);
+  random.Fill(&rgb[0], rgb.size());
+  uint16_t lut[256];
+  for (int i = 0; i < 256; ++i) lut[i] = i << 3;
+
+  // The bits of the first chain in the GPIO word, and in packed bytes.
+  const ColorBitLayout gpio = { 17, { 0, 1, 5, 6, 7, 8 } };
+  const ColorBitLayout packed = { 0, { 0, 1, 2, 3, 4, 5 } };
+
+  printf("Conversion to %d bitplanes, Mpixel/s:\n", kPlanes);
+  printf("  32 bit words:  vectorized %7.1f  scalar %7.1f\n",
+         Measure<uint32_t>((MapFunction32) MapToBitplanes, gpio, lut, rgb)
+         * 1e-6,
+         Measure<uint32_t>((MapFunction32) MapToBitplanesScalar, gpio, lut,
+                           rgb) * 1e-6);
+  printf("  packed bytes:  vectorized %7.1f  scalar %7.1f\n",
+         Measure<uint8_t>((MapFunction8) MapToBitplanes, packed, lut, rgb)
+         * 1e-6,
+         Measure<uint8_t>((MapFunction8) MapToBitplanesScalar, packed, lut,
+                          rgb) * 1e-6);
+  return 0;
+}
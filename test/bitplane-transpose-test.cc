@@ -0,0 +1,121 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// MapToBitplanes() has to give exactly the same result as the scalar
+// reference, whichever vector version it was compiled with. Checked with
+// random layouts, colors, planes and rows of every width modulo the block
+// size, with and without the upper or lower sub-panel.
+
+#include "bitplane-transpose-internal.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+static const int kPlanes = 11;
+
+static const char *VectorName() {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  return "NEON";
+#elif defined(__AVX2__)
+  return "AVX2";
+#elif defined(__SSE2__)
+  return "SSE2";
+#else
+  return "none, scalar only";
+#endif
+}
+
+// Six different bit offsets, with all bits below "bits".
+static ColorBitLayout RandomLayout(TestRandom *random, int bits) {
+  ColorBitLayout layout;
+  int highest = 0;
+  for (int k = 0; k < 6; ++k) {
+    bool taken;
+    do {
+      layout.offset[k] = random->Uniform(bits < 16 ? bits : 16);
+      taken = false;
+      for (int j = 0; j < k; ++j) taken |= layout.offset[j] == layout.offset[k];
+    } while (taken);
+    if (layout.offset[k] > highest) highest = layout.offset[k];
+  }
+  layout.shift = random->Uniform(bits - highest);
+  return layout;
+}
+
+template <typename Word>
+static bool TestWidth(TestRandom *random, int width, const char *word_name) {
+  const ColorBitLayout layout = RandomLayout(random, 8 * sizeof(Word));
+  uint16_t lut[256];
+  for (int i = 0; i < 256; ++i) lut[i] = random->Next();
+  std::vector<uint8_t> upper(3 * width + 1), lower(3 * width + 1);
+  random->Fill(&upper[0], upper.size());
+  random->Fill(&lower[0], lower.size());
+  const bool with_upper = random->Uniform(4) != 0;
+  const bool with_lower = random->Uniform(4) != 0;
+  const int min_plane = random->Uniform(kPlanes);
+  const int max_plane = min_plane + 1 + random->Uniform(kPlanes - min_plane);
+  const int stride = width + random->Uniform(4);
+
+  // The words around the pixels, and the bits that are not ours, have to
+  // stay as they are.
+  std::vector<Word> expected(kPlanes * stride + 16);
+  random->Fill((uint8_t*) &expected[0], expected.size() * sizeof(Word));
+  std::vector<Word> result(expected);
+
+  MapToBitplanesScalar(layout, lut, with_upper ? &upper[0] : NULL,
+                       with_lower ? &lower[0] : NULL, width,
+                       min_plane, max_plane, &expected[0], stride);
+  MapToBitplanes(layout, lut, with_upper ? &upper[0] : NULL,
+                 with_lower ? &lower[0] : NULL, width,
+                 min_plane, max_plane, &result[0], stride);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    if (result[i] != expected[i]) {
+      fprintf(stderr, "%s: width %d, planes %d..%d, upper %d, lower %d: "
+              "word %d (plane %d, pixel %d) is 0x%x, expected 0x%x\n",
+              word_name, width, min_plane, max_plane - 1, with_upper,
+              with_lower, (int) i, (int) i / stride, (int) i % stride,
+              (unsigned) result[i], (unsigned) expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+#if defined(__AVX2__) && defined(__GNUC__)
+  if (!__builtin_cpu_supports("avx2")) {
+    printf("bitplane-transpose-test: this CPU has no AVX2, skipped\n");
+    return 0;
+  }
+#endif
+  TestRandom random(1);
+  int checks = 0;
+  for (int width = 0; width <= 4 * 32 + 1; ++width) {
+    for (int i = 0; i < 40; ++i, checks += 2) {
+      if (!TestWidth<uint32_t>(&random, width, "32 bit words")
+          || !TestWidth<uint8_t>(&random, width, "packed bytes")) {
+        return 1;
+      }
+    }
+  }
+  printf("bitplane-transpose-test (vectorized: %s): %d rows OK\n",
+         VectorName(), checks);
+  return 0;
+}
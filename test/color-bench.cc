@@ -0,0 +1,82 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Throughput of SetPixel() and Fill() on a chain of six panels, with and
+// without luminance correction, at 11 and 5 PWM bits. Only uses the
+// RGBMatrix API that has been there for long, so that it can be built
+// against older versions of the library to compare: "make
+// color-baseline-bench BASELINE=<source tree>" (see Makefile).
+
+#include "led-matrix.h"
+#include "test-util.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+// Runs "function" on "matrix" for about half a second. Returns calls per
+// second.
+template <typename Function>
+static double CallsPerSecond(RGBMatrix *matrix, Function function) {
+  long calls = 0;
+  const double start = GetTimeSeconds();
+  double now;
+  do {
+    for (int i = 0; i < 10; ++i) calls += function(matrix, calls);
+    now = GetTimeSeconds();
+  } while (now - start < 0.5);
+  return calls / (now - start);
+}
+
+static std::vector<uint8_t> random_colors;
+
+// All pixels of the matrix with random colors, one SetPixel() each.
+static long SetAllPixels(RGBMatrix *matrix, long round) {
+  const int width = matrix->width(), height = matrix->height();
+  const uint8_t *color = &random_colors[(round % 7) * 3];
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, color += 3) {
+      matrix->SetPixel(x, y, color[0], color[1], color[2]);
+    }
+  }
+  return width * height;
+}
+
+static long FillMatrix(RGBMatrix *matrix, long round) {
+  matrix->Fill(round, round >> 8, round >> 16);
+  return 1;
+}
+
+int main() {
+  RGBMatrix matrix(NULL, 32, 6);  // No refresh thread.
+  TestRandom random(1);
+  random_colors.resize(3 * (matrix.width() * matrix.height() + 7));
+  random.Fill(&random_colors[0], random_colors.size());
+
+  printf("%-10s %-8s %14s %10s\n", "luminance", "pwm bits", "SetPixel()/s",
+         "Fill()/s");
+  for (int luminance = 1; luminance >= 0; --luminance) {
+    for (int pwm_bits = 11; pwm_bits >= 5; pwm_bits -= 6) {
+      matrix.set_luminance_correct(luminance);
+      matrix.SetPWMBits(pwm_bits);
+      printf("%-10s %-8d %13.1fM %10.0f\n", luminance ? "corrected" : "linear",
+             pwm_bits, CallsPerSecond(&matrix, SetAllPixels) * 1e-6,
+             CallsPerSecond(&matrix, FillMatrix));
+    }
+  }
+  return 0;
+}
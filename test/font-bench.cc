@@ -0,0 +1,140 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Time to load fonts from BDF and from the font cache, and to look up
+// glyphs in them: ASCII from the direct index, other scripts from the
+// sorted glyphs. The fonts in fonts/ have no CJK, so those lookups search
+// in vain, as for any character the font lacks.
+//   font-bench [<bdf-font-file>...]
+
+#include "graphics.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace rgb_matrix;
+
+volatile int lookup_sink;  // Keeps the lookups from being optimized away.
+
+static const char *const kDefaultFonts[] = {
+  "../fonts/4x6.bdf", "../fonts/7x13.bdf", "../fonts/10x20.bdf"
+};
+
+// Loads "path" over and over for about half a second. Returns the
+// microseconds per load, or a negative value if it can't be loaded.
+static double MicrosPerLoad(const char *path) {
+  long loads = 0;
+  const double start = GetTimeSeconds();
+  double now;
+  do {
+    Font font;
+    if (!font.LoadFont(path)) return -1;
+    ++loads;
+    now = GetTimeSeconds();
+  } while (now - start < 0.5);
+  return (now - start) * 1e6 / loads;
+}
+
+// Looks up all of "codepoints" over and over for about half a second.
+// Returns lookups per second; "found" is set to how many of them are in
+// the font.
+static double LookupsPerSecond(const Font &font,
+                               const std::vector<uint32_t> &codepoints,
+                               int *found) {
+  *found = 0;
+  for (size_t i = 0; i < codepoints.size(); ++i) {
+    if (font.CharacterWidth(codepoints[i]) >= 0) ++*found;
+  }
+  long lookups = 0;
+  int checksum = 0;
+  const double start = GetTimeSeconds();
+  double now;
+  do {
+    for (size_t i = 0; i < codepoints.size(); ++i) {
+      checksum += font.CharacterWidth(codepoints[i]);
+    }
+    lookups += codepoints.size();
+    now = GetTimeSeconds();
+  } while (now - start < 0.5);
+  lookup_sink = checksum;
+  return lookups / (now - start);
+}
+
+static std::vector<uint32_t> Range(uint32_t first, uint32_t last) {
+  std::vector<uint32_t> result;
+  for (uint32_t cp = first; cp <= last; ++cp) result.push_back(cp);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<const char*> fonts(argv + 1, argv + argc);
+  if (fonts.empty()) {
+    const int count = sizeof(kDefaultFonts) / sizeof(*kDefaultFonts);
+    fonts.assign(kDefaultFonts, kDefaultFonts + count);
+  }
+
+  struct {
+    const char *name;
+    std::vector<uint32_t> codepoints;
+  } scripts[] = {
+    { "ASCII", Range(0x20, 0x7e) },
+    { "Cyrillic", Range(0x400, 0x4ff) },
+    { "CJK", Range(0x4e00, 0x4fff) },
+  };
+
+  char cache[] = "/tmp/font-bench-XXXXXX";
+  const int fd = mkstemp(cache);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  printf("%-20s %12s %12s  %s\n", "font", "BDF load", "cache load",
+         "lookups (found/looked up)");
+  int result = 0;
+  for (size_t f = 0; f < fonts.size(); ++f) {
+    Font font;
+    if (!font.LoadFont(fonts[f]) || !font.SaveCache(cache)) {
+      fprintf(stderr, "Couldn't load %s or write it to %s\n",
+              fonts[f], cache);
+      result = 1;
+      continue;
+    }
+    const char *name = fonts[f];
+    for (const char *p = name; *p; ++p) {
+      if (*p == '/') name = p + 1;
+    }
+    printf("%-20s %10.0fus %10.1fus ", name, MicrosPerLoad(fonts[f]),
+           MicrosPerLoad(cache));
+
+    Font cached;
+    cached.LoadFont(cache);
+    for (size_t s = 0; s < sizeof(scripts) / sizeof(*scripts); ++s) {
+      int found;
+      const double per_second
+        = LookupsPerSecond(cached, scripts[s].codepoints, &found);
+      printf(" %s %.0fM/s (%d/%d)", scripts[s].name, per_second * 1e-6,
+             found, (int) scripts[s].codepoints.size());
+    }
+    printf("\n");
+  }
+  unlink(cache);
+  return result;
+}
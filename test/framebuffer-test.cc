@@ -0,0 +1,346 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Frames written out to a SimulatedGPIO have to light each LED exactly as
+// long as the color of its pixel asks for.
+
+#include "led-matrix.h"
+#include "simulated-gpio.h"
+#include "test-util.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace rgb_matrix;
+
+static const int kBitPlanes = 11;
+static const long kBaseNanos = 100;
+
+// The matrix to test with and a description of it for the messages.
+struct Setup {
+  Setup() : pwm_bits(kBitPlanes), brightness(100) {
+    options.bitplane_base_nanos = kBaseNanos;
+  }
+
+  std::string Describe() const {
+    static const char *const kMultiplexing[] = {
+      "direct", "stripe", "checkered"
+    };
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "rows %d, chain %d, parallel %d, %s, %s, pwm bits %d, "
+             "brightness %d%s",
+             options.rows, options.chained_displays, options.parallel_chains,
+             kMultiplexing[options.multiplexing],
+             options.bitplane_layout == RGBMatrix::kPackedBitplanes
+             ? "packed" : "full words", pwm_bits, brightness,
+             options.temporal_dithering ? ", dithering" : "");
+    return buffer;
+  }
+
+  // A SimulatedGPIO for a canvas "width" pixels wide. With the outdoor
+  // multiplexings, it decodes the panels as they are scanned out: half the
+  // rows, twice the columns.
+  SimulatedGPIO *CreateSimulation(int width) const {
+    const bool direct = (options.multiplexing
+                         == RGBMatrix::kDirectMultiplexing);
+    return new SimulatedGPIO(direct ? options.rows : options.rows / 2,
+                             direct ? width : 2 * width, 16,
+                             options.parallel_chains);
+  }
+
+  // Where pixel (x, y) of the canvas is in the simulation. With the outdoor
+  // multiplexings, a row address lights four rows: the same row of each
+  // quarter of the panel. The upper and lower quarter of each half share
+  // the shift register, which is twice as long as the panel is wide: the
+  // lower quarter is clocked in first. With kStripeMultiplexing, one after
+  // the other; with kCheckeredMultiplexing, taking turns every 16 columns.
+  void ScanPosition(int x, int y, int *scan_x, int *scan_y) const {
+    if (options.multiplexing == RGBMatrix::kDirectMultiplexing) {
+      *scan_x = x;
+      *scan_y = y;
+      return;
+    }
+    const int chain = y / options.rows, chain_y = y % options.rows;
+    const int half = options.rows / 2, quarter = options.rows / 4;
+    const bool upper_quarter = (chain_y % half) < quarter;
+    const int panel = x / 32, panel_x = x % 32;
+    if (options.multiplexing == RGBMatrix::kStripeMultiplexing) {
+      *scan_x = 64 * panel + (upper_quarter ? 32 : 0) + panel_x;
+    } else {
+      *scan_x = (64 * panel + 32 * (panel_x / 16) + (upper_quarter ? 16 : 0)
+                 + panel_x % 16);
+    }
+    *scan_y = chain * half + (chain_y / half) * quarter + chain_y % quarter;
+  }
+
+  // With temporal dithering, each bitplane below the PWM bits is lit for
+  // its time on average over this many refreshes.
+  int DitherRefreshes() const {
+    return options.temporal_dithering ? 1 << (kBitPlanes - pwm_bits) : 1;
+  }
+
+  RGBMatrix::Options options;
+  int pwm_bits;
+  int brightness;
+};
+
+// A matrix without refresh thread, set up as in "setup"; frames are
+// written out with FrameCanvas::DumpToMatrix().
+class TestMatrix {
+public:
+  explicit TestMatrix(const Setup &setup)
+    : setup_(setup), matrix_(NULL, setup.options) {
+    matrix_.set_luminance_correct(false);
+    matrix_.SetPWMBits(setup.pwm_bits);
+    matrix_.SetBrightness(setup.brightness);
+  }
+
+  RGBMatrix *matrix() { return &matrix_; }
+  FrameCanvas *CreateFrame() { return matrix_.CreateFrameCanvas(); }
+
+  // Write "frame" out "refreshes" times to a new SimulatedGPIO, then
+  // compare the on-time of each LED with what the colors in "expected"
+  // (3 bytes per pixel of the canvas) ask for, times "refreshes". With
+  // temporal dithering, "refreshes" has to be a multiple of
+  // DitherRefreshes(). If "elapsed_nanos" is not NULL, it is set to the
+  // time the refreshes took.
+  bool Expect(FrameCanvas *frame, const std::vector<uint8_t> &expected,
+              const char *what, int refreshes = 1,
+              uint64_t *elapsed_nanos = NULL) {
+    const int width = frame->width(), height = frame->height();
+    SimulatedGPIO *sim = setup_.CreateSimulation(width);
+    for (int i = 0; i < refreshes; ++i) frame->DumpToMatrix(sim);
+    bool result = true;
+    for (int y = 0; y < height && result; ++y) {
+      for (int x = 0; x < width && result; ++x) {
+        int scan_x, scan_y;
+        setup_.ScanPosition(x, y, &scan_x, &scan_y);
+        uint64_t on_time[3];
+        sim->GetOnTime(scan_x, scan_y, &on_time[0], &on_time[1], &on_time[2]);
+        for (int c = 0; c < 3; ++c) {
+          const uint8_t value = expected[3 * (y * width + x) + c];
+          const uint64_t nanos = refreshes * ExpectedNanos(value);
+          if (on_time[c] != nanos) {
+            fprintf(stderr, "%s (%s): pixel (%d, %d) channel %d, value %d: "
+                    "lit %llu ns, expected %llu ns\n", what,
+                    setup_.Describe().c_str(), x, y, c, value,
+                    (unsigned long long) on_time[c],
+                    (unsigned long long) nanos);
+            result = false;
+            break;
+          }
+        }
+      }
+    }
+    if (elapsed_nanos) *elapsed_nanos = sim->elapsed_nanos();
+    delete sim;
+    return result;
+  }
+
+private:
+  // Without luminance correction, the 8 bits of a color channel are the
+  // upper 8 of the 11 bitplanes. The planes below the PWM bits are not
+  // shown, unless with temporal dithering, where they are on average;
+  // each plane is lit twice as long as the one below. The brightness
+  // scales the on-time of each plane, rounded down to full nanoseconds; as
+  // kBaseNanos is 100, that is exact.
+  uint64_t ExpectedNanos(uint8_t value) const {
+    const int lowest = (setup_.options.temporal_dithering
+                        ? 0 : kBitPlanes - setup_.pwm_bits);
+    return ((value << 3) >> lowest << lowest) * kBaseNanos
+      * setup_.brightness / 100;
+  }
+
+  const Setup setup_;
+  RGBMatrix matrix_;
+};
+
+// SetPixel(), SetPixels() and Fill() with random colors.
+static bool TestDrawing(const Setup &setup) {
+  TestMatrix test(setup);
+  FrameCanvas *frame = test.CreateFrame();
+  const int width = frame->width(), height = frame->height();
+  std::vector<uint8_t> pixels(3 * width * height);
+  TestRandom random(width + height);
+  random.Fill(&pixels[0], pixels.size());
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const uint8_t *p = &pixels[3 * (y * width + x)];
+      frame->SetPixel(x, y, p[0], p[1], p[2]);
+    }
+  }
+  if (!test.Expect(frame, pixels, "SetPixel()"))
+    return false;
+
+  frame->Clear();
+  frame->SetPixels(0, 0, width, height, &pixels[0], 3 * width);
+  if (!test.Expect(frame, pixels, "SetPixels()"))
+    return false;
+
+  const uint8_t color[3] = { 255, 77, 1 };
+  for (int i = 0; i < width * height * 3; ++i) pixels[i] = color[i % 3];
+  frame->Fill(color[0], color[1], color[2]);
+  if (!test.Expect(frame, pixels, "Fill()"))
+    return false;
+
+  // All color bits of all planes on; with INVERSE_RGB_DISPLAY_COLORS, all
+  // of them low, as in a dark plane without inversion.
+  std::fill(pixels.begin(), pixels.end(), 255);
+  frame->Fill(255, 255, 255);
+  if (!test.Expect(frame, pixels, "Fill() white"))
+    return false;
+
+  std::fill(pixels.begin(), pixels.end(), 0);
+  frame->Clear();
+  return test.Expect(frame, pixels, "Clear()");
+}
+
+// Parallel chains are clocked in at the same time: a refresh takes as
+// many writes as with one chain.
+static bool TestParallelWrites(const Setup &setup) {
+  uint64_t writes[3];
+  for (int parallel = 1; parallel <= 3; ++parallel) {
+    Setup parallel_setup(setup);
+    parallel_setup.options.parallel_chains = parallel;
+    TestMatrix test(parallel_setup);
+    FrameCanvas *frame = test.CreateFrame();
+    std::vector<uint8_t> pixels(3 * frame->width() * frame->height());
+    TestRandom random(parallel);
+    random.Fill(&pixels[0], pixels.size());
+    frame->SetPixels(0, 0, frame->width(), frame->height(), &pixels[0],
+                     3 * frame->width());
+    SimulatedGPIO *sim = parallel_setup.CreateSimulation(frame->width());
+    frame->DumpToMatrix(sim);
+    writes[parallel - 1] = sim->write_count();
+    delete sim;
+  }
+  if (writes[1] != writes[0] || writes[2] != writes[0]) {
+    fprintf(stderr, "Refresh writes (%s) with 1, 2, 3 chains: %llu %llu %llu\n",
+            setup.Describe().c_str(), (unsigned long long) writes[0],
+            (unsigned long long) writes[1], (unsigned long long) writes[2]);
+    return false;
+  }
+  return true;
+}
+
+// The brightness scales the time the LEDs are lit linearly, but the
+// refresh takes as long as at full brightness.
+static bool TestBrightness(const Setup &setup) {
+  static const int kPercent[] = { 100, 80, 50, 33, 10, 1, 0 };
+  uint64_t full_nanos = 0;
+  for (int i = 0; i < 7; ++i) {
+    Setup dimmed(setup);
+    dimmed.brightness = kPercent[i];
+    TestMatrix test(dimmed);
+    FrameCanvas *frame = test.CreateFrame();
+    const int width = frame->width(), height = frame->height();
+    std::vector<uint8_t> pixels(3 * width * height);
+    TestRandom random(width);
+    random.Fill(&pixels[0], pixels.size());
+    frame->SetPixels(0, 0, width, height, &pixels[0], 3 * width);
+    uint64_t elapsed_nanos;
+    if (!test.Expect(frame, pixels, "SetBrightness()", 1, &elapsed_nanos))
+      return false;
+    if (i == 0) full_nanos = elapsed_nanos;
+    if (elapsed_nanos != full_nanos) {
+      fprintf(stderr, "Refresh (%s) takes %llu ns, at full brightness %llu\n",
+              dimmed.Describe().c_str(), (unsigned long long) elapsed_nanos,
+              (unsigned long long) full_nanos);
+      return false;
+    }
+  }
+  return true;
+}
+
+// With temporal dithering, the planes below the PWM bits take turns: over
+// a whole cycle of refreshes, each LED is lit as long as with all PWM bits,
+// also when dimmed. Every refresh takes the same time.
+static bool TestDithering(const Setup &setup) {
+  static const int kPercent[] = { 100, 33 };
+  for (int i = 0; i < 2; ++i) {
+    Setup dithered(setup);
+    dithered.options.temporal_dithering = true;
+    dithered.brightness = kPercent[i];
+    TestMatrix test(dithered);
+    FrameCanvas *frame = test.CreateFrame();
+    const int width = frame->width(), height = frame->height();
+    std::vector<uint8_t> pixels(3 * width * height);
+    TestRandom random(height);
+    random.Fill(&pixels[0], pixels.size());
+    frame->SetPixels(0, 0, width, height, &pixels[0], 3 * width);
+    // One refresh first, so that the cycle doesn't start with the first
+    // plane in turn.
+    SimulatedGPIO *sim = dithered.CreateSimulation(width);
+    frame->DumpToMatrix(sim);
+    const uint64_t refresh_nanos = sim->elapsed_nanos();
+    delete sim;
+    const int cycle = dithered.DitherRefreshes();
+    uint64_t cycle_nanos;
+    if (!test.Expect(frame, pixels, "Temporal dithering", cycle,
+                     &cycle_nanos))
+      return false;
+    if (refresh_nanos * cycle != cycle_nanos) {
+      fprintf(stderr, "Dithered refresh (%s) takes %llu ns, but %llu over "
+              "%d refreshes\n", dithered.Describe().c_str(),
+              (unsigned long long) refresh_nanos,
+              (unsigned long long) cycle_nanos, cycle);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  int failures = 0, count = 0;
+  for (int packed = 0; packed < 2; ++packed) {
+    for (int multiplexing = 0; multiplexing < 3; ++multiplexing) {
+      // 64 rows are only scanned directly.
+      for (int rows = 16; rows <= (multiplexing ? 32 : 64); rows *= 2) {
+        for (int pwm_bits = 4; pwm_bits <= kBitPlanes; pwm_bits += 7) {
+          Setup setup;
+          setup.options.rows = rows;
+          setup.options.multiplexing
+            = static_cast<RGBMatrix::Multiplexing>(multiplexing);
+          setup.options.chained_displays = 2;
+          setup.options.bitplane_layout = (packed
+                                           ? RGBMatrix::kPackedBitplanes
+                                           : RGBMatrix::kFullWordBitplanes);
+          setup.pwm_bits = pwm_bits;
+          for (int parallel = 1; parallel <= 3; ++parallel) {
+            setup.options.parallel_chains = parallel;
+            failures += !TestDrawing(setup);
+            ++count;
+          }
+          failures += !TestParallelWrites(setup);
+          failures += !TestBrightness(setup);
+          failures += !TestDithering(setup);
+          count += 3;
+        }
+      }
+    }
+  }
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+  const char *const name = "framebuffer-inverse-test";
+#else
+  const char *const name = "framebuffer-test";
+#endif
+  printf("%s: %d of %d setups OK\n", name, count - failures, count);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// A panel arrangement read from a file ("@<file>" in
+// RGBMatrix::Options::panel_arrangement) has to show the pixels where the
+// same arrangement given directly does.
+
+#include "led-matrix.h"
+#include "simulated-gpio.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using namespace rgb_matrix;
+
+// The on-time of all LEDs after writing out random pixels once.
+static std::vector<uint64_t> ShowRandomPixels(const char *arrangement) {
+  RGBMatrix::Options options;
+  options.chained_displays = 4;
+  options.panel_arrangement = arrangement;
+  RGBMatrix matrix(NULL, options);
+  FrameCanvas *frame = matrix.CreateFrameCanvas();
+  std::vector<uint8_t> pixels(3 * frame->width() * frame->height());
+  TestRandom random(1);
+  random.Fill(&pixels[0], pixels.size());
+  frame->SetPixels(0, 0, frame->width(), frame->height(), &pixels[0],
+                   3 * frame->width());
+
+  SimulatedGPIO sim(options.rows, 32 * options.chained_displays);
+  frame->DumpToMatrix(&sim);
+  std::vector<uint64_t> result;
+  result.push_back(frame->width());
+  result.push_back(frame->height());
+  for (int y = 0; y < options.rows; ++y) {
+    for (int x = 0; x < 32 * options.chained_displays; ++x) {
+      uint64_t on_time[3];
+      sim.GetOnTime(x, y, &on_time[0], &on_time[1], &on_time[2]);
+      result.insert(result.end(), on_time, on_time + 3);
+    }
+  }
+  return result;
+}
+
+int main() {
+  char path[] = "/tmp/pixel-mapper-test-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  const char spec[] =
+    "# Top row, left to right.\n"
+    "0,0  1,0\n"
+    "# Bottom row, right to left, upside down.\n"
+    "1,1:R180  0,1:R180\n";
+  const bool written = (write(fd, spec, sizeof(spec) - 1)
+                        == (ssize_t) sizeof(spec) - 1);
+  close(fd);
+
+  const std::string from_file = std::string("@") + path;
+  const bool same = (written
+                     && ShowRandomPixels(from_file.c_str())
+                     == ShowRandomPixels("serpentine 2x2"));
+  const bool arranged = (ShowRandomPixels(from_file.c_str())
+                         != ShowRandomPixels(NULL));
+  unlink(path);
+  if (!same || !arranged) {
+    fprintf(stderr, "pixel-mapper-test: arrangement from a file %s\n",
+            same ? "is not applied" : "differs from the one given directly");
+    return 1;
+  }
+  printf("pixel-mapper-test: arrangement from a file OK\n");
+  return 0;
+}
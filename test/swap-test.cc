@@ -0,0 +1,69 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// A frame handed to SwapOnVSync() by one thread has to be shown, even if
+// another thread waits for the vertical sync with SwapOnVSync(NULL) in the
+// meantime.
+
+#include "led-matrix.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace rgb_matrix;
+
+// An output that takes its time, so that a refresh lasts a few
+// milliseconds; what is written doesn't matter.
+class SlowOutput : public OutputBackend {
+public:
+  virtual uint32_t InitOutputs(uint32_t outputs) { return outputs; }
+  virtual void SetBits(uint32_t value) {}
+  virtual void ClearBits(uint32_t value) {}
+  virtual long SleepNanos(long nanos) {
+    usleep(nanos / 100 + 1);
+    return nanos;
+  }
+};
+
+class Swapper : public Thread {
+public:
+  Swapper(RGBMatrix *matrix, FrameCanvas *frame)
+    : matrix_(matrix), frame_(frame) {}
+  virtual void Run() { matrix_->SwapOnVSync(frame_); }
+
+private:
+  RGBMatrix *const matrix_;
+  FrameCanvas *const frame_;
+};
+
+int main() {
+  SlowOutput output;
+  RGBMatrix matrix(&output, 16, 1);
+  const int kRounds = 50;
+  int lost = 0;
+  for (int i = 0; i < kRounds; ++i) {
+    FrameCanvas *frame = matrix.CreateFrameCanvas();
+    matrix.SwapOnVSync(NULL);  // Start right after a vertical sync.
+    Swapper swapper(&matrix, frame);
+    swapper.Start();
+    usleep(200);               // Most likely while it waits.
+    matrix.SwapOnVSync(NULL);
+    swapper.WaitStopped();
+    if (matrix.SwapOnVSync(NULL) != frame) ++lost;
+  }
+  printf("swap-test: %d of %d frames shown\n", kRounds - lost, kRounds);
+  return lost == 0 ? 0 : 1;
+}
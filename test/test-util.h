@@ -0,0 +1,50 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Little helpers shared by the tests and benchmarks.
+#ifndef RPI_TEST_UTIL_H
+#define RPI_TEST_UTIL_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic time in seconds, for the benchmarks.
+static inline double GetTimeSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Small pseudo random number generator, so that the tests see the same
+// numbers everywhere.
+class TestRandom {
+public:
+  explicit TestRandom(uint32_t seed) : state_(seed * 2654435761u + 1) {}
+  uint32_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 17;
+    state_ ^= state_ << 5;
+    return state_;
+  }
+  int Uniform(int n) { return Next() % n; }  // 0 <= result < n
+  void Fill(uint8_t *data, int size) {
+    for (int i = 0; i < size; ++i) data[i] = Next() >> 24;
+  }
+
+private:
+  uint32_t state_;
+};
+
+#endif  // RPI_TEST_UTIL_H
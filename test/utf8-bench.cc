@@ -0,0 +1,117 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Throughput of the UTF-8 decoding for DrawText(), on a megabyte of ASCII
+// text and of text in several scripts: in batches with utf8_decode() as
+// DrawText() does, and one character at a time with utf8_next_codepoint().
+
+#include "utf8-internal.h"
+#include "test-util.h"
+
+#include <stdio.h>
+
+#include <string>
+
+volatile uint32_t decoded_sink;  // Keeps the decoding from being dropped.
+
+// Words of "length" random letters from "alphabet" (UTF-8, "letters"
+// characters), separated by spaces, up to "size" bytes.
+static std::string RandomWords(TestRandom *random, const char *alphabet,
+                               int letters, size_t size) {
+  // The alphabet's characters all have the same number of bytes.
+  const int bytes = strlen(alphabet) / letters;
+  std::string text;
+  while (text.size() < size) {
+    const int length = 1 + random->Uniform(9);
+    for (int i = 0; i < length; ++i) {
+      text.append(alphabet + bytes * random->Uniform(letters), bytes);
+    }
+    text += ' ';
+  }
+  return text;
+}
+
+// Decodes "text" over and over for about half a second, "batch"
+// characters at a time, or one at a time with utf8_next_codepoint() if
+// "batch" is 0. Returns bytes per second of the fastest round, which is
+// the least disturbed by other processes; "characters" is set to the
+// number of characters in "text".
+static double BytesPerSecond(const std::string &text, int batch,
+                             long *characters) {
+  uint32_t checksum = 0;
+  double fastest = 1e9;
+  const double start = GetTimeSeconds();
+  double now = start;
+  do {
+    const double round_start = now;
+    const char *it = text.data();
+    const char *const end = it + text.size();
+    *characters = 0;
+    if (batch == 0) {
+      while (it < end) {
+        checksum += utf8_next_codepoint(it, end);
+        ++*characters;
+      }
+    } else {
+      uint32_t codepoints[64];
+      while (it < end) {
+        const int count = utf8_decode(it, end, codepoints, batch);
+        checksum += codepoints[count - 1];
+        *characters += count;
+      }
+    }
+    now = GetTimeSeconds();
+    if (now - round_start < fastest) fastest = now - round_start;
+  } while (now - start < 0.5);
+  decoded_sink = checksum;
+  return text.size() / fastest;
+}
+
+int main() {
+  static const size_t kSize = 1 << 20;
+  TestRandom random(1);
+  const std::string ascii = RandomWords(
+    &random, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ", 52, kSize);
+
+  // A few words in each script in turn.
+  static const struct { const char *alphabet; int letters; } kScripts[] = {
+    { "abcdefghijklmnopqrstuvwxyz", 26 },
+    { "\xc3\xa4\xc3\xb6\xc3\xbc\xc3\x9f\xc3\xa9\xc3\xa8", 6 },  // Latin-1
+    { "\xd0\xb0\xd0\xb1\xd0\xb2\xd0\xb3\xd0\xb4\xd0\xb5", 6 },  // Cyrillic
+    { "\xe4\xb8\x80\xe4\xba\x8c\xe4\xb8\x89\xe5\x9b\x9b", 4 },  // CJK
+    { "\xf0\x9f\x98\x80\xf0\x9f\x98\x8e", 2 },                  // Emoji
+  };
+  std::string mixed;
+  for (int s = 0; mixed.size() < kSize; s = (s + 1) % 5) {
+    mixed += RandomWords(&random, kScripts[s].alphabet, kScripts[s].letters,
+                         40);
+  }
+
+  const struct { const char *name; const std::string *text; } kTexts[] = {
+    { "ASCII", &ascii }, { "mixed", &mixed }
+  };
+  printf("%-6s %8s  %22s  %22s\n", "text", "chars",
+         "utf8_decode() x 64", "utf8_next_codepoint()");
+  for (int t = 0; t < 2; ++t) {
+    long characters;
+    const double batched = BytesPerSecond(*kTexts[t].text, 64, &characters);
+    const double single = BytesPerSecond(*kTexts[t].text, 0, &characters);
+    const double mb = 1e-6, mchars = 1e-6 * characters / kTexts[t].text->size();
+    printf("%-6s %7.2fM  %7.0fMB/s %7.0fMc/s  %7.0fMB/s %7.0fMc/s\n",
+           kTexts[t].name, characters * 1e-6, batched * mb, batched * mchars,
+           single * mb, single * mchars);
+  }
+  return 0;
+}
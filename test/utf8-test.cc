@@ -0,0 +1,305 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2014 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// The UTF-8 decoding in utf8-internal.h, fed with random text that is
+// mostly, but not quite UTF-8, has to agree with a slow reference decoder
+// that knows nothing but the encoding of each codepoint.
+
+#include "utf8-internal.h"
+#include "test-util.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// A byte sequence of up to four bytes and its length, as one number.
+static uint64_t SequenceKey(const uint8_t *bytes, int length) {
+  uint64_t key = length;
+  for (int i = 0; i < length; ++i) key = (key << 8) | bytes[i];
+  return key;
+}
+
+static int Encode(uint32_t cp, uint8_t *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+static bool IsCharacter(uint32_t cp) {
+  return cp <= 0x10FFFF && (cp < 0xD800 || cp > 0xDFFF);
+}
+
+// The encodings of all codepoints and all their beginnings. The longest
+// beginning of the input found here is what a character or a replacement
+// character consumes.
+class ReferenceDecoder {
+public:
+  ReferenceDecoder() {
+    for (uint32_t cp = 0; cp <= 0x10FFFF; ++cp) {
+      if (!IsCharacter(cp)) continue;
+      uint8_t bytes[4];
+      const int length = Encode(cp, bytes);
+      complete_.push_back(std::make_pair(SequenceKey(bytes, length), cp));
+      for (int i = 1; i < length; ++i) {
+        incomplete_.push_back(SequenceKey(bytes, i));
+      }
+    }
+    std::sort(complete_.begin(), complete_.end());
+    std::sort(incomplete_.begin(), incomplete_.end());
+    incomplete_.erase(std::unique(incomplete_.begin(), incomplete_.end()),
+                      incomplete_.end());
+  }
+
+  // Decode the character at "pos" of "text"; returns how many bytes it
+  // takes.
+  int Next(const std::string &text, size_t pos, uint32_t *cp) const {
+    const uint8_t *bytes = (const uint8_t*) text.data() + pos;
+    const int available = std::min<size_t>(4, text.size() - pos);
+    int longest = 1;
+    *cp = kUtf8Replacement;
+    for (int length = 1; length <= available; ++length) {
+      const uint64_t key = SequenceKey(bytes, length);
+      std::vector<Entry>::const_iterator found
+        = std::lower_bound(complete_.begin(), complete_.end(),
+                           Entry(key, 0));
+      if (found != complete_.end() && found->first == key) {
+        *cp = found->second;
+        return length;
+      }
+      if (!IsIncomplete(bytes, length))
+        break;
+      longest = length;
+    }
+    return longest;
+  }
+
+  // Whether "bytes" begin a character, but are not a complete one.
+  bool IsIncomplete(const uint8_t *bytes, int length) const {
+    return std::binary_search(incomplete_.begin(), incomplete_.end(),
+                              SequenceKey(bytes, length));
+  }
+
+private:
+  typedef std::pair<uint64_t, uint32_t> Entry;
+  std::vector<Entry> complete_;
+  std::vector<uint64_t> incomplete_;
+};
+
+// Mostly characters of all lengths, some of them cut short, with invalid
+// bytes, continuation bytes and the lead bytes at the edge of the valid
+// ranges mixed in.
+static std::string RandomText(TestRandom *random, int length) {
+  static const uint8_t kEdges[] = {
+    0x7F, 0x80, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4,
+    0xF5, 0xFF, 0x9F, 0xA0, 0x8F, 0x90
+  };
+  static const uint32_t kRangeStart[] = { 0, 0x80, 0x800, 0x10000 };
+  static const uint32_t kRangeSize[] = { 0x80, 0x780, 0xF800, 0x100000 };
+  std::string text;
+  while ((int) text.size() < length) {
+    const int kind = random->Uniform(10);
+    if (kind < 6) {
+      const int range = random->Uniform(4);
+      const uint32_t cp = kRangeStart[range]
+        + random->Next() % kRangeSize[range];
+      uint8_t bytes[4];
+      int size = Encode(cp, bytes);
+      // Some are cut short; surrogates are not characters anyway.
+      if (kind == 0 && size > 1) size = 1 + random->Uniform(size - 1);
+      text.append((const char*) bytes, size);
+    } else if (kind < 8) {
+      text += (char) kEdges[random->Uniform(sizeof(kEdges))];
+    } else {
+      text += (char) (random->Next() >> 24);
+    }
+  }
+  return text;
+}
+
+// Codepoints and the positions after each, decoded by "reference".
+struct Decoded {
+  std::vector<uint32_t> codepoints;
+  std::vector<size_t> ends;
+};
+
+static Decoded DecodeReference(const ReferenceDecoder &reference,
+                               const std::string &text) {
+  Decoded result;
+  for (size_t pos = 0; pos < text.size(); /**/) {
+    uint32_t cp;
+    pos += reference.Next(text, pos, &cp);
+    result.codepoints.push_back(cp);
+    result.ends.push_back(pos);
+  }
+  return result;
+}
+
+static void PrintText(const std::string &text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    fprintf(stderr, " %02x", (uint8_t) text[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+// Character by character with utf8_next_codepoint().
+static bool TestNextCodepoint(const std::string &text,
+                              const Decoded &expected) {
+  const char *it = text.data();
+  const char *const end = it + text.size();
+  for (size_t i = 0; i < expected.codepoints.size(); ++i) {
+    const uint32_t cp = utf8_next_codepoint(it, end);
+    if (cp != expected.codepoints[i]
+        || (size_t) (it - text.data()) != expected.ends[i]) {
+      fprintf(stderr, "utf8_next_codepoint(): character %d is U+%04X "
+              "ending at %d, expected U+%04X ending at %d in",
+              (int) i, cp, (int) (it - text.data()),
+              expected.codepoints[i], (int) expected.ends[i]);
+      PrintText(text);
+      return false;
+    }
+  }
+  return true;
+}
+
+// In batches of random size with utf8_decode(), which takes ASCII eight
+// bytes at a time.
+static bool TestDecode(TestRandom *random, const std::string &text,
+                       const Decoded &expected) {
+  const char *it = text.data();
+  const char *const end = it + text.size();
+  std::vector<uint32_t> codepoints;
+  while (it < end) {
+    uint32_t batch[70];
+    const int max = 1 + random->Uniform(70);
+    const int count = utf8_decode(it, end, batch, max);
+    if (count < 1 || count > max) {
+      fprintf(stderr, "utf8_decode(): %d characters, max %d\n", count, max);
+      return false;
+    }
+    codepoints.insert(codepoints.end(), batch, batch + count);
+    if (codepoints.size() > expected.codepoints.size()
+        || (size_t) (it - text.data()) != expected.ends[codepoints.size() - 1])
+      break;
+  }
+  if (codepoints != expected.codepoints) {
+    fprintf(stderr, "utf8_decode(): decodes differently:");
+    PrintText(text);
+    return false;
+  }
+  return true;
+}
+
+// Cut into blocks at random, as text read from a pipe: the incomplete
+// character at the end of a block is decoded with the next one. That has
+// to give the same as decoding all at once.
+static bool TestBlocks(const ReferenceDecoder &reference, TestRandom *random,
+                       const std::string &text) {
+  std::string pending;
+  std::vector<uint32_t> codepoints;
+  for (size_t pos = 0; pos < text.size(); /**/) {
+    const size_t block = std::min<size_t>(1 + random->Uniform(12),
+                                          text.size() - pos);
+    pending.append(text, pos, block);
+    pos += block;
+    const char *it = pending.data();
+    const char *const begin = it, *const end = it + pending.size();
+
+    // The tail is the longest end that begins a character, if any.
+    int expected_tail = 0;
+    for (int back = 1; back <= 3 && back <= end - begin; ++back) {
+      if (reference.IsIncomplete((const uint8_t*) end - back, back))
+        expected_tail = back;
+    }
+    const int tail = utf8_incomplete_tail(begin, end);
+    if (tail != expected_tail) {
+      fprintf(stderr, "utf8_incomplete_tail() is %d, expected %d of",
+              tail, expected_tail);
+      PrintText(pending);
+      return false;
+    }
+    const char *const decode_end = (pos < text.size()) ? end - tail : end;
+    while (it < decode_end) {
+      codepoints.push_back(utf8_next_codepoint(it, decode_end));
+    }
+    pending.erase(0, it - begin);
+  }
+  const Decoded expected = DecodeReference(reference, text);
+  if (codepoints != expected.codepoints) {
+    fprintf(stderr, "Decoded in blocks differently:");
+    PrintText(text);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  const ReferenceDecoder reference;
+  TestRandom random(21);
+  int failures = 0, count = 0;
+  for (int i = 0; i < 20000; ++i, ++count) {
+    const std::string text = RandomText(&random, 1 + random.Uniform(40));
+    const Decoded expected = DecodeReference(reference, text);
+    failures += !(TestNextCodepoint(text, expected)
+                  && TestDecode(&random, text, expected)
+                  && TestBlocks(reference, &random, text));
+    if (failures > 10) break;
+  }
+
+  // Every character on its own, and long runs of ASCII with something
+  // else in between, for the eight bytes at a time.
+  for (uint32_t cp = 0; cp <= 0x10FFFF; ++cp) {
+    if (!IsCharacter(cp)) continue;
+    uint8_t bytes[4];
+    const std::string text((const char*) bytes, Encode(cp, bytes));
+    const char *it = text.data();
+    if (utf8_next_codepoint(it, it + text.size()) != cp
+        || it != text.data() + text.size()) {
+      fprintf(stderr, "U+%04X is not decoded\n", cp);
+      ++failures;
+    }
+  }
+  ++count;
+  for (int i = 0; i < 2000; ++i, ++count) {
+    std::string text;
+    while (text.size() < 100) {
+      text.append(random.Uniform(20), 'a' + random.Uniform(26));
+      text += RandomText(&random, random.Uniform(3));
+    }
+    const Decoded expected = DecodeReference(reference, text);
+    failures += !TestDecode(&random, text, expected);
+  }
+
+  printf("utf8-test: %d of %d texts OK\n", count - failures, count);
+  return failures == 0 ? 0 : 1;
+}
@@ -8,11 +8,14 @@
 #include "graphics.h"
 
 #include <getopt.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 using namespace rgb_matrix;
 
 static int usage(const char *progname) {
@@ -26,7 +29,9 @@ static int usage(const char *progname) {
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
           "\t-x <x-origin> : X-Origin of displaying text (Default: 0)\n"
           "\t-y <y-origin> : Y-Origin of displaying text (Default: 0)\n"
-          "\t-C <r,g,b>    : Color. Default 255,255,0\n");
+          "\t-C <r,g,b>    : Color. Default 255,255,0\n"
+          "\t-s <ms>       : Scroll the text as ticker, one pixel every "
+          "<ms> milliseconds.\n");
   return 1;
 }
 
@@ -34,6 +39,44 @@ static bool parseColor(Color *c, const char *str) {
   return sscanf(str, "%hhu,%hhu,%hhu", &c->r, &c->g, &c->b) == 3;
 }
 
+// Scroll the text from stdin through the line at "y" until it ends. The
+// text is rendered once into a TextStrip as it comes in, while it is a
+// screen ahead of what is shown; what has scrolled past is dropped.
+static void RunTicker(RGBMatrix *matrix, const Font &font, int y,
+                      const Color &color, int scroll_ms) {
+  const Color black(0, 0, 0);
+  TextStrip strip(font);
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  const int screen = matrix->width();
+  bool eof = false;
+  for (;;) {
+    while (!eof && strip.width() < 2 * screen) {
+      struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+      if (poll(&input, 1, 0) <= 0)
+        break;  // Nothing new yet.
+      char buffer[256];
+      const ssize_t len = read(STDIN_FILENO, buffer, sizeof(buffer));
+      if (len <= 0) {
+        eof = true;
+        break;
+      }
+      std::replace(buffer, buffer + len, '\n', ' ');
+      strip.Append(buffer, len);
+    }
+    // While waiting for more, there is empty space after the text, so new
+    // text comes in from the right edge.
+    if (!eof && strip.width() < screen)
+      strip.AppendSpace(screen - strip.width());
+    if (eof && strip.width() == 0)
+      break;
+
+    strip.Draw(offscreen, 0, y + font.baseline(), 0, color, &black);
+    offscreen = matrix->SwapOnVSync(offscreen);
+    usleep(scroll_ms * 1000);
+    strip.Discard(1);  // The strip starts at the left edge.
+  }
+}
+
 int main(int argc, char *argv[]) {
   Color color(255, 255, 0);
   const char *bdf_font_file = NULL;
@@ -41,15 +84,17 @@ int main(int argc, char *argv[]) {
   int chain = 1;
   int x_orig = 0;
   int y_orig = -1;
+  int scroll_ms = -1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "r:c:x:y:f:C:")) != -1) {
+  while ((opt = getopt(argc, argv, "r:c:x:y:f:C:s:")) != -1) {
     switch (opt) {
     case 'r': rows = atoi(optarg); break;
     case 'c': chain = atoi(optarg); break;
     case 'x': x_orig = atoi(optarg); break;
     case 'y': y_orig = atoi(optarg); break;
     case 'f': bdf_font_file = strdup(optarg); break;
+    case 's': scroll_ms = atoi(optarg); break;
     case 'C':
       if (!parseColor(&color, optarg)) {
         fprintf(stderr, "Invalid color spec.\n");
@@ -65,7 +110,8 @@ int main(int argc, char *argv[]) {
   }
 
   /*
-   * Load font. This needs to be a filename with a bdf bitmap font.
+   * Load font. This needs to be a filename with a bdf bitmap font, or a
+   * font cache made from it with font-cache.
    */
   rgb_matrix::Font font;
   if (!font.LoadFont(bdf_font_file)) {
@@ -95,6 +141,12 @@ int main(int argc, char *argv[]) {
   const int x = x_orig;
   int y = y_orig;
 
+  if (scroll_ms >= 0) {
+    RunTicker(canvas, font, y, color, scroll_ms);
+    delete canvas;
+    return 0;
+  }
+
   if (isatty(STDIN_FILENO)) {
     // Only give a message if we are interactive. If connected via pipe, be quiet
     printf("Enter lines. Full screen or empty line clears screen.\n"